@@ -1,18 +1,137 @@
+#define _GNU_SOURCE
+
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Per-CPU caches need restartable sequences, registered by glibc 2.35 and later
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#else
+#define HAVE_RSEQ 0
+#endif
 
 #include "alloc.h"
 
-#define BLOCK_SIZE 64                                                   // Make sure the blocks can hold *most* generic datatypes.
-#define BLOCK_COUNT 1024                                                // 1024 blocks per slab.
+#define SLAB_SIZE (64 * 1024)                                           // Every slab spans (and is aligned to) 64KiB, whatever its size class.
+#define SLAB_SHIFT 16                                                   // log2 of SLAB_SIZE, the granularity of the page map.
+#define REGION_SIZE (4 * 1024 * 1024)                                  // Slabs are carved out of 4MiB reservations aligned to their size.
+#define META_SPAN (2 * 1024 * 1024)                                     // The first slab of every META_SPAN aligned chunk holds the chunk's slab descriptors.
+#define SPAN_CLASS SLAB_SIZE_CLASSES                                    // size_class of a descriptor heading a large allocation.
+#define SPAN_SLABS_MAX (META_SPAN / SLAB_SIZE - 1)                      // Longest span carved from a chunk, larger ones get their own mapping.
+#define MAPPING_CACHE_COUNT 8                                           // Freed large mappings a page source keeps for reuse...
+#define MAPPING_CACHE_MAX (64 * 1024 * 1024)                            // ...as long as they are no longer than this.
+#define HUGE_REGION_SIZE (1024 * 1024 * 1024)                           // Region size when backed by 1GiB pages.
+#define BLOCK_SIZE 64                                                   // Size served by the plain slab_alloc() entry point.
+#define OBJECT_MAX_SIZE (SLAB_SIZE / 8)                                 // Largest object stride of an object cache, so every slab holds a few.
+#define OBJECT_NAME_MAX 32                                              // Bytes of an object cache's name that are kept, terminator included.
 #define ALIGN_UP(x, align) (((x) + ((align) - 1)) & ~((align) - 1))     // Align x to the next multiple of align
-#define SLAB_OVERHEAD ALIGN_UP(sizeof(Slab), BLOCK_SIZE)                // This is how many blocks are used by the slab pointer.
-#define EFFECTIVE_BLOCKS (BLOCK_COUNT - SLAB_OVERHEAD)                  // This is how many blocks we can use.
-#define BLOCK_CACHE_LIMIT 64
-#define BLOCK_CACHE_REFILL_LIMIT 32
+#define DEPOT_LIMIT 64                                                  // Full magazines the depot keeps per size class before spilling to slabs.
+#define THREAD_EMPTY_SLABS 1                                            // Fully free slabs a thread keeps per size class before releasing them.
+#define OBJECT_EMPTY_SLABS 16                                           // Same for object caches, where a released slab costs a round of dtor and ctor calls.
+#define HEAP_SLAB_MAX (1024 * 1024)                                     // Largest slab a heap can be configured with.
+#define ARENA_CHUNK_SIZE SLAB_SIZE                                      // Arenas bump allocate from chunks of this size...
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)                         // ...and give requests above this a span of their own.
+#define PAGE_RETAIN_HIGH 64                                             // Committed free slabs the page source holds before decommitting...
+#define PAGE_RETAIN_LOW 32                                              // ...down to this many, so small oscillations don't re-fault pages.
+#define DECOMMIT_ADVICE MADV_DONTNEED                                   // MADV_FREE is cheaper but RSS only drops under memory pressure.
+#define MAX_NUMA_NODES 8                                                // Nodes with their own page source and depot. Higher nodes share node 0's.
+#define ADDRESS_BITS 47                                                 // Width of user space addresses covered by the page map.
+#define PAGE_MAP_LEAF_BITS 16                                           // Slabs covered by one page map leaf, 4GiB of address space.
+#define PAGE_MAP_ROOT_BITS (ADDRESS_BITS - SLAB_SHIFT - PAGE_MAP_LEAF_BITS) // Leaves in the page map root.
+#define MPOL_PREFERRED 1                                                // From linux/mempolicy.h, spelled out so libnuma isn't needed.
+#define PERCPU_SLOTS 31                                                 // Blocks each CPU caches per size class (one 256 byte record).
+#define PERCPU_SHIFT 13                                                 // log2 of the stride between two CPUs' caches.
+#define PERCPU_BATCH 16                                                 // Blocks moved between a CPU cache and the slabs at once.
+
+// Older headers don't carry the hugetlb page size selectors
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#define REMOTE_QUEUED ((uintptr_t)1)                                    // Tag bit on Slab.remote_free: the slab is queued on its owner.
+
+// Bump a ThreadStats counter. Only the owning thread writes its counters, so a relaxed
+// load and store (a plain add) is enough and slab_stats() can still read them safely.
+#define STAT_ADD(counter, n) atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+
+// Block sizes for each size class. Four classes per power of two keeps internal
+// fragmentation under 25% while still fitting in a handful of cache lines.
+static const size_t size_classes[SLAB_SIZE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+
+// A full magazine parked in the depot.
+typedef struct magazine {
+    void *rounds[SLAB_MAGAZINE_SIZE];   // The magazine's blocks.
+} Magazine;
+
+// Global store of full magazines for one size class, shared by every thread. Pages of
+// the stack are only touched once the depot actually grows into them.
+typedef struct depot {
+    pthread_mutex_t lock;               // Guards the magazine stack.
+    Magazine full[DEPOT_LIMIT];         // Stack of full magazines.
+    _Atomic size_t count;               // Number of magazines on the stack.
+} Depot;
+
+static Depot depots[MAX_NUMA_NODES][SLAB_SIZE_CLASSES];
+
+// Per NUMA node source of slab memory. Slabs are carved from large aligned mmap
+// reservations and released slabs are kept for reuse, so slab growth never goes
+// through malloc.
+typedef struct pagesource {
+    pthread_mutex_t lock;               // Guards everything below.
+    int node;                           // NUMA node the source's memory is bound to.
+    char *bump;                         // Next uncarved slab in the current region.
+    char *bump_end;                     // End of the current region.
+    Slab *free_runs[SPAN_SLABS_MAX + 1];    // Free runs of slabs by length, linked through their first descriptor.
+    size_t free_slabs;                  // Slabs in free runs.
+    size_t free_count;                  // Slabs in free runs that are still backed by memory.
+    size_t slabs_out;                   // Slabs currently handed out to threads.
+    size_t mapped_bytes;                // Address space reserved from the OS.
+    Slab *mappings;                     // Cached large mappings, linked through their descriptors.
+    size_t mapping_count;               // Number of cached mappings.
+    size_t mapping_bytes;               // Total length of the cached mappings.
+    size_t large_bytes;                 // Bytes in spans and mappings handed out.
+    Slab *descriptors;                  // Spare descriptors for large mappings, which have no chunk of their own.
+    Slab *regions;                      // Reserved regions, linked through the descriptor of their first slab, which never holds blocks.
+} PageSource;
+
+static PageSource page_sources[MAX_NUMA_NODES];
+
+// Leaf of the page map, one descriptor pointer per slab of a 4GiB range.
+typedef struct pagemapleaf {
+    _Atomic(Slab *) slabs[1 << PAGE_MAP_LEAF_BITS];    // Descriptor of each slab, NULL if the memory isn't ours.
+} PageMapLeaf;
+
+// Two level radix tree from every SLAB_SIZE unit of the address space to the descriptor
+// of the slab or large allocation it belongs to. The root lives in BSS and leaves are
+// mapped the first time memory lands in their range, so only the pages covering memory
+// actually in use are ever touched. Leaves are never unmapped.
+static _Atomic(PageMapLeaf *) page_map[1 << PAGE_MAP_ROOT_BITS];
+static pthread_mutex_t page_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static int numa_nodes = 1;                                  // Number of nodes in use, 1 disables NUMA placement.
+static _Atomic int page_mode = SLAB_PAGES_DEFAULT;          // Kind of pages new regions are backed by.
+static _Atomic int prefetch_mode = SLAB_PREFETCH_NONE;      // How the next block of a magazine is prefetched.
 
 // Key for cleaning up thread cache after use.
 static pthread_key_t thread_cache_key;
@@ -20,43 +139,130 @@ static pthread_once_t init_once = PTHREAD_ONCE_INIT;
 
 static __thread ThreadCache *thread_cache = NULL;
 
+// Caches are never freed: every cache ever created is on the registry, and caches of
+// exited threads are also on the orphan list along with the slabs they still own.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadCache *orphans = NULL;
+static ThreadCache *all_caches = NULL;
+
+// Every live heap and object cache, so their page sources show up in the statistics
+// and their locks can be taken around fork().
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static SlabHeap *all_heaps = NULL;
+
+// An allocator instance serving blocks of one size, independent of the size classes.
+// It carves slabs of its own geometry and every thread gets a separate ThreadCache
+// for it, whose first class is the only one in use. Heaps created on their own draw
+// from a private page source, so destroying one drops all of its memory at once.
+// Object caches are heaps on the shared page sources whose objects are constructed
+// when their slab is populated and destructed when it is released, so they stay
+// constructed while they cycle through the caches.
+struct slabheap {
+    char name[OBJECT_NAME_MAX];         // Name given at creation, for debugging.
+    size_t block_size;                  // Stride between blocks, free link included.
+    size_t link_offset;                 // Offset of the free link, past the object if it has constructed state.
+    size_t slab_slabs;                  // Length of each slab in SLAB_SIZE units.
+    size_t magazine_size;               // Blocks per magazine in the heap's thread caches.
+    size_t empty_slabs;                 // Fully free slabs each thread keeps before releasing them.
+    void (*ctor)(void *);               // Runs once per object when its slab is populated, may be NULL.
+    void (*dtor)(void *);               // Runs once per object when its slab is released, may be NULL.
+    PageSource *pages;                  // Page source of the heap's slabs, NULL for the per node ones.
+    PageSource private_pages;           // The page source of a standalone heap.
+    pthread_key_t key;                  // Key of each thread's ThreadCache for this heap.
+    pthread_mutex_t lock;               // Guards the lists below.
+    ThreadCache *orphans;               // Caches of exited threads, waiting for a new thread.
+    ThreadCache *caches;                // Every ThreadCache created for this heap.
+    struct slabheap *next_heap;         // Next heap in the registry of all heaps.
+    struct slabheap *prev_heap;         // Previous heap in the registry, so a heap unlinks in place.
+};
+
+// A region of memory that is only ever freed as a whole. Allocations are carved from
+// chunks with a bump pointer; chunks and larger allocations are spans from the page
+// source. The arena itself lives at the start of its first chunk.
+struct slabarena {
+    char *bump;                         // Next free byte of the current chunk.
+    char *end;                          // End of the current chunk.
+    char *base;                         // First free byte of the first chunk, past the header living there.
+    Slab *first;                        // Descriptor of the chunk holding the arena.
+    Slab *spans;                        // Every other chunk and large allocation, newest first, linked through their descriptors.
+};
+
+// A node in a tree of arenas. Resetting or deleting a context takes its whole subtree
+// with it. The context lives at the start of its arena's first chunk.
+struct slabcontext {
+    SlabArena arena;                    // Where the context's memory comes from.
+    SlabContext *parent;                // Context this one was created under, NULL for a root.
+    SlabContext *children;              // Newest child context.
+    SlabContext *next_sibling;          // Next older child of the parent.
+    SlabContext *prev_sibling;          // Next newer child of the parent, so a child unlinks in place.
+};
+
+static void slab_thread_destructor(void *arg);
+static void thread_free(ThreadCache *thread, Slab *parent, Block *b);
+static void move_to_node(ThreadCache *thread, int node);
+static void slab_prefork();
+static void slab_postfork();
+
 /*
- * Free up a thread's cache.
+ * Map a request size to the index of the smallest size class that can hold it.
  * Arguments:
- *     void *arg - Pointer to the thread cache.
+ *     size_t size - The requested size in bytes (must be <= SLAB_MAX_SIZE).
+ * Returns:
+ *     size_t - Index into size_classes.
  */
-static void slab_thread_destructor(void *arg) {
-    ThreadCache *cache = (ThreadCache *)arg;
-    if(!cache) return;
+static inline size_t size_to_class(size_t size) {
+    // Sizes up to 128 bytes are spaced 16 bytes apart
+    if(size <= 128)
+        return size ? (size - 1) >> 4 : 0;
 
-    // Free up the current slab list
-    Slab *slab = cache->current_slab;
-    while(slab) {
-        Slab *next = slab->next;
+    // Above that, every power of two is split into four evenly spaced classes
+    size_t lg = 63 - __builtin_clzl(size - 1);
+    return 8 + (lg - 7) * 4 + (((size - 1) >> (lg - 2)) & 3);
+}
 
-        // Deallocate blocks
-        if(slab->raw_allocation)
-            free(slab->raw_allocation);
+/*
+ * Count the CPUs or NUMA nodes the kernel may bring online from a sysfs range list.
+ * Reads it with raw syscalls since this runs before the allocator is usable.
+ * Arguments:
+ *     const char *path - A sysfs "possible" file such as /sys/devices/system/node/possible.
+ *     int limit - Upper bound on the result.
+ * Returns:
+ *     int - Highest listed id plus one, capped at limit, or 1 if the file can't be read.
+ */
+static int count_possible(const char *path, int limit) {
+    char buffer[64];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return 1;
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if(length <= 0) return 1;
+    buffer[length] = '\0';
 
-        // Deallocate slab
-        slab = next;
+    // The file is a range list like "0" or "0-3"; the highest node ends it
+    int highest = 0;
+    for(char *c = buffer; *c; c++) {
+        if(*c < '0' || *c > '9') continue;
+        highest = 0;
+        while(*c >= '0' && *c <= '9')
+            highest = highest * 10 + (*c++ - '0');
+        if(!*c) break;
     }
 
-    // Free up the partial slab list
-    slab = cache->partial_slabs;
-    while(slab) {
-        Slab *next = slab->next;
-
-        // Deallocate blocks
-        if(slab->raw_allocation)
-            free(slab->raw_allocation);
+    int count = highest + 1;
+    return count > limit ? limit : count;
+}
 
-        // Deallocate slab
-        slab = next;
-    }
+/*
+ * Find the NUMA node the calling thread is running on.
+ * Returns:
+ *     int - Index of the node's page source and depots.
+ */
+static int current_node() {
+    if(numa_nodes == 1) return 0;
 
-    // Deallocate cache
-    free(cache);
+    unsigned int cpu, node;
+    if(getcpu(&cpu, &node) != 0 || node >= (unsigned int)numa_nodes) return 0;
+    return (int)node;
 }
 
 /*
@@ -64,6 +270,48 @@ static void slab_thread_destructor(void *arg) {
  */
 static void slab_global_init() {
     pthread_key_create(&thread_cache_key, slab_thread_destructor);
+    pthread_atfork(slab_prefork, slab_postfork, slab_postfork);
+
+    numa_nodes = count_possible("/sys/devices/system/node/possible", MAX_NUMA_NODES);
+
+    for(int node = 0; node < MAX_NUMA_NODES; node++) {
+        pthread_mutex_init(&page_sources[node].lock, NULL);
+        page_sources[node].node = node;
+
+        for(int i = 0; i < SLAB_SIZE_CLASSES; i++)
+            pthread_mutex_init(&depots[node][i].lock, NULL);
+    }
+}
+
+/*
+ * Adopt an orphaned cache or create a new one. The cache isn't bound to any thread yet.
+ * Returns:
+ *     ThreadCache * - The cache or NULL if memory is exhausted.
+ */
+static ThreadCache *new_thread_cache() {
+    pthread_mutex_lock(&cache_lock);
+    ThreadCache *cache = orphans;
+    if(cache)
+        orphans = cache->next_orphan;
+    pthread_mutex_unlock(&cache_lock);
+
+    if(!cache) {
+        // Map it directly, the allocator may be standing in for malloc itself
+        cache = mmap(NULL, sizeof(ThreadCache) + SLAB_SIZE_CLASSES * sizeof(ClassCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(cache == MAP_FAILED) return NULL;
+        cache->class_count = SLAB_SIZE_CLASSES;
+
+        pthread_mutex_lock(&cache_lock);
+        cache->next_cache = all_caches;
+        all_caches = cache;
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    // An orphan may come from another node, its slabs there get parked
+    cache->next_orphan = NULL;
+    cache->magazine_size = SLAB_MAGAZINE_SIZE;
+    move_to_node(cache, current_node());
+    return cache;
 }
 
 /*
@@ -75,13 +323,14 @@ static ThreadCache *get_thread_cache() {
     // Set the initialization function if this hasn't been called before
     pthread_once(&init_once, slab_global_init);
 
-    // Attempt to get the thread cache, if it doesn't exist create a new one
+    // Attempt to get the thread cache, if it doesn't exist adopt an orphaned one or create a new one
     ThreadCache *cache = (ThreadCache *)pthread_getspecific(thread_cache_key);
     if(!cache) {
-        cache = calloc(1, sizeof(ThreadCache)); // Zero-init
+        cache = new_thread_cache();
+        if(!cache) return NULL;
         pthread_setspecific(thread_cache_key, cache);
-        thread_cache = cache;
     }
+    thread_cache = cache;
     return cache;
 }
 
@@ -97,168 +346,2927 @@ static inline ThreadCache *fast_thread_cache() {
 }
 
 /*
- * Allocate a new slab. This will be called if the current slab is full.
- * Arguments:
- *     ThreadCache *current_context - The thread we are allocating from or NULL if there is no context.
+ * Get the NUMA node of the calling thread's cache, which picks the page source large
+ * allocations come from. Large allocations don't need the cache itself, so they
+ * still work when it couldn't be created.
  * Returns:
- *     Slab * - An initialized slab ready for use or NULL on error.
+ *     int - The node.
  */
-static Slab *allocate_new_slab() {
-    size_t alignment = BLOCK_SIZE * BLOCK_COUNT;
-    size_t total_size = alignment + alignment; // Extra space for alignment
+static inline int thread_node() {
+    ThreadCache *thread = fast_thread_cache();
+    return thread ? thread->node : current_node();
+}
 
-    // Allocate the slab memory and check for errors
-    void *raw_mem = malloc(total_size);
-    if(!raw_mem) return NULL;
+_Static_assert(META_SPAN / SLAB_SIZE * sizeof(Slab) <= SLAB_SIZE, "Slab descriptors outgrew their slab");
+_Static_assert(SLAB_SIZE == 1 << SLAB_SHIFT, "SLAB_SHIFT doesn't match SLAB_SIZE");
+_Static_assert(SLAB_SIZE / 16 <= SLAB_MAP_WORDS * 64, "Free map can't cover a slab of the smallest class");
 
-    // Align the memory
-    uintptr_t aligned_addr = ALIGN_UP((uintptr_t)raw_mem, alignment);
+/*
+ * Find the descriptor a slab of region memory is tracked by. Descriptors live out of
+ * line in a dense array at the start of every META_SPAN chunk, so slabs hold nothing
+ * but blocks and the page source can get at a slab's descriptor by pointer arithmetic.
+ * Arguments:
+ *     void *mem - Memory inside a slab region.
+ * Returns:
+ *     Slab * - The descriptor of the slab mem falls in.
+ */
+static inline Slab *chunk_slab(void *mem) {
+    uintptr_t addr = (uintptr_t)mem;
+    Slab *descriptors = (Slab *)(addr & ~((uintptr_t)META_SPAN - 1));
+    return &descriptors[(addr & (META_SPAN - 1)) / SLAB_SIZE];
+}
 
-    // Store the slab at the beginning of the memory region
-    Slab *slab = (Slab *)aligned_addr;
+/*
+ * Look an arbitrary address up in the page map.
+ * Arguments:
+ *     void *ptr - Any pointer.
+ * Returns:
+ *     Slab * - Descriptor of the slab or large allocation ptr falls in, NULL if the
+ *              memory doesn't belong to the allocator.
+ */
+static inline Slab *page_map_get(void *ptr) {
+    uintptr_t unit = (uintptr_t)ptr >> SLAB_SHIFT;
+    if(unit >> (PAGE_MAP_ROOT_BITS + PAGE_MAP_LEAF_BITS)) return NULL;
 
-    // Set slab metadata
-    slab->free_count = EFFECTIVE_BLOCKS;
+    PageMapLeaf *leaf = atomic_load_explicit(&page_map[unit >> PAGE_MAP_LEAF_BITS], memory_order_acquire);
+    return leaf ? atomic_load_explicit(&leaf->slabs[unit & ((1 << PAGE_MAP_LEAF_BITS) - 1)], memory_order_relaxed) : NULL;
+}
 
-    // Store the slab's memory as the allocated memory
-    slab->mem = (void *)aligned_addr;
-    slab->raw_allocation = raw_mem;
-    *((Slab **)slab->mem) = slab;
-
-    // Calculate where the actual blocks start (after the slab)
-    void *block_start = (char *)slab->mem + (SLAB_OVERHEAD * BLOCK_SIZE);
-
-    // Zero out blocks to load them into RAM
-    memset(block_start, 0, EFFECTIVE_BLOCKS * BLOCK_SIZE);
-    
-    // Set the free list
-    Block *current = (Block *)block_start;
-    slab->free_list = current;
-
-    // Link the blocks
-    for(int i = 0; i < EFFECTIVE_BLOCKS - 1; i++) {
-        void *next_block_mem = (char *)current + BLOCK_SIZE;
-        Block *next_block = (Block *)next_block_mem;
-        current->next = next_block;
-        current = next_block;
-    }
-    current->next = NULL;
-
-    // Add to the slab list if a current context was provided
-    ThreadCache *cache = fast_thread_cache();
-    slab->next = cache->current_slab;
-    cache->current_slab = slab;
+/*
+ * Find the descriptor of the slab or large allocation a block belongs to. The block
+ * must have come from the allocator, so the page map is known to cover it.
+ * Arguments:
+ *     void *block - A block handed out by the allocator.
+ * Returns:
+ *     Slab * - The slab that owns the block.
+ */
+static inline Slab *slab_of(void *block) {
+    uintptr_t unit = (uintptr_t)block >> SLAB_SHIFT;
+    PageMapLeaf *leaf = atomic_load_explicit(&page_map[unit >> PAGE_MAP_LEAF_BITS], memory_order_acquire);
+    return atomic_load_explicit(&leaf->slabs[unit & ((1 << PAGE_MAP_LEAF_BITS) - 1)], memory_order_relaxed);
+}
 
-    return slab;
+/*
+ * Find the chain link of a block. Blocks of the size classes hold their link at the
+ * start, constructed objects keep theirs past the object so a free never overwrites
+ * their state. The link stays inside the block's stride, so it maps to the same bit
+ * of the free map as the block.
+ * Arguments:
+ *     Slab *slab - The slab that owns the block.
+ *     void *block - The block.
+ * Returns:
+ *     Block * - The block's link.
+ */
+static inline Block *block_link(Slab *slab, void *block) {
+    return (Block *)((char *)block + slab->link_offset);
 }
 
 /*
- * Allocate a block from the slab allocator. Try to allocate from the thread's slabs first.
- * If there are no slabs in the thread, create a new one.
+ * Reserve a region of memory with a given alignment. mmap only guarantees page
+ * alignment, so over-reserve by the alignment and trim the excess on both sides.
+ * Arguments:
+ *     size_t size - Size of the region, a multiple of the page size.
+ *     size_t align - Alignment of the region, a power of two.
  * Returns:
- *      void * - A block of memory for the thread to use or NULL on empty.
+ *     void * - The aligned region or NULL on error.
  */
-void *slab_alloc() {
-    ThreadCache *cache = fast_thread_cache();
-    Block *block = NULL;
+static void *reserve_aligned(size_t size, size_t align) {
+    char *raw = mmap(NULL, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED) return NULL;
+
+    char *aligned = (char *)ALIGN_UP((uintptr_t)raw, align);
+    size_t head = aligned - raw;
+    size_t tail = align - head;
+
+    if(head)
+        munmap(raw, head);
+    if(tail)
+        munmap(aligned + size, tail);
+
+    return aligned;
+}
 
-    // Try to allocate from the block fastbin (fastest)
-    if(cache->fastbin) {
-        block = cache->fastbin;
-        cache->fastbin = block->next;
-        cache->fastbin_count--;
-        return (void *)block;
+/*
+ * Prefer the page source's node for fresh memory; the kernel still falls back if the
+ * node runs dry. Does nothing on machines with a single node.
+ * Arguments:
+ *     PageSource *source - The page source the memory is for.
+ *     void *mem - Start of the memory, page aligned.
+ *     size_t length - Length of the memory.
+ */
+static void bind_to_node(PageSource *source, void *mem, size_t length) {
+    if(numa_nodes > 1) {
+        unsigned long mask = 1UL << source->node;
+        syscall(SYS_mbind, mem, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
     }
+}
 
-    // Try to allocate from thread local cache (fast)
-    if(cache->current_slab && cache->current_slab->free_count) {
-        // Allocate from the cached slab
-        Slab *slab = cache->current_slab;
+/*
+ * Point the page map entries of a range of memory at a descriptor, mapping the leaves
+ * the range needs on the way. Entries are only ever written by whoever holds the
+ * memory, so the lock is only needed to map a missing leaf. They are still atomic:
+ * lookups of foreign pointers and the reuse of unmapped address space can meet a
+ * writer, and a relaxed access costs no more than a plain one.
+ * Arguments:
+ *     char *mem - Start of the memory, SLAB_SIZE aligned.
+ *     size_t length - Length of the memory, a multiple of SLAB_SIZE.
+ *     Slab *slab - Descriptor to record, or NULL to hand the memory back.
+ * Returns:
+ *     int - 0 on success, -1 if the range is out of reach or a leaf couldn't be mapped.
+ */
+static int page_map_set(char *mem, size_t length, Slab *slab) {
+    uintptr_t first = (uintptr_t)mem >> SLAB_SHIFT;
+    uintptr_t last = ((uintptr_t)mem + length) >> SLAB_SHIFT;
+    if(last > (uintptr_t)1 << (PAGE_MAP_ROOT_BITS + PAGE_MAP_LEAF_BITS)) return -1;
 
-        // Check if we have enough to partially refil fastbin
-        if(cache->current_slab->free_count > BLOCK_CACHE_REFILL_LIMIT) {
-            // Partially refill fastbin
-            Block *batch[BLOCK_CACHE_REFILL_LIMIT];
+    for(uintptr_t unit = first; unit < last; unit++) {
+        _Atomic(PageMapLeaf *) *root = &page_map[unit >> PAGE_MAP_LEAF_BITS];
+        PageMapLeaf *leaf = atomic_load_explicit(root, memory_order_acquire);
+        if(!leaf) {
+            // Nothing to clear in a range that was never mapped
+            if(!slab) continue;
 
-            for(int i = 0; i < BLOCK_CACHE_REFILL_LIMIT; i++) {
-                batch[i] = slab->free_list;
-                slab->free_list = batch[i]->next;
-                slab->free_count--;
+            pthread_mutex_lock(&page_map_lock);
+            if(!(leaf = atomic_load_explicit(root, memory_order_relaxed))) {
+                leaf = mmap(NULL, sizeof(PageMapLeaf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(leaf == MAP_FAILED) {
+                    pthread_mutex_unlock(&page_map_lock);
+                    return -1;
+                }
+                atomic_store_explicit(root, leaf, memory_order_release);
             }
+            pthread_mutex_unlock(&page_map_lock);
+        }
+        atomic_store_explicit(&leaf->slabs[unit & ((1 << PAGE_MAP_LEAF_BITS) - 1)], slab, memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+/*
+ * Point every slab of region memory at its own descriptor in the page map, for a
+ * fresh region or for the tail of a multi-slab run that is being broken up. The
+ * descriptor slabs at the start of every chunk stay unmapped, they never hold blocks.
+ * Arguments:
+ *     char *mem - Start of the memory, SLAB_SIZE aligned.
+ *     size_t length - Length of the memory, a multiple of SLAB_SIZE.
+ * Returns:
+ *     int - 0 on success, -1 if the page map couldn't cover a fresh region.
+ */
+static int page_map_reset(char *mem, size_t length) {
+    for(char *slab = mem; slab < mem + length; slab += SLAB_SIZE) {
+        if(((uintptr_t)slab & (META_SPAN - 1)) == 0) continue;
+
+        if(page_map_set(slab, SLAB_SIZE, chunk_slab(slab)) < 0) {
+            page_map_set(mem, length, NULL);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reserve a new region to carve slabs from, backed by the configured kind of pages.
+ * Explicit huge pages come from the hugetlb pool, which is often empty, so each mode
+ * falls back to the next smaller page size and finally to regular pages with a
+ * transparent huge page hint. On NUMA machines the region is bound to the source's
+ * node before anything touches it. Must be called with the page source lock held.
+ * Arguments:
+ *     PageSource *source - The page source the region is for.
+ *     size_t *size - Receives the size of the region.
+ * Returns:
+ *     char * - The region (aligned to at least META_SPAN) or NULL on error.
+ */
+static char *reserve_region(PageSource *source, size_t *size) {
+    char *region;
+
+    switch(atomic_load_explicit(&page_mode, memory_order_relaxed)) {
+    case SLAB_PAGES_HUGETLB_1G:
+        region = mmap(NULL, HUGE_REGION_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        if(region != MAP_FAILED) {
+            *size = HUGE_REGION_SIZE;
+            break;
+        }
+        // fall through
+    case SLAB_PAGES_HUGETLB_2M:
+        // Huge page mappings are aligned to the page size, which is plenty for slabs
+        region = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if(region != MAP_FAILED) {
+            *size = REGION_SIZE;
+            break;
+        }
+        // fall through
+    case SLAB_PAGES_THP:
+        region = reserve_aligned(REGION_SIZE, REGION_SIZE);
+        if(region)
+            madvise(region, REGION_SIZE, MADV_HUGEPAGE);
+        *size = REGION_SIZE;
+        break;
+    default:
+        region = reserve_aligned(REGION_SIZE, REGION_SIZE);
+        *size = REGION_SIZE;
+        break;
+    }
+
+    if(region)
+        bind_to_node(source, region, *size);
+
+    return region;
+}
+
+/*
+ * Take a free run off its list. Both ends are untagged so a neighbour that is freed
+ * in the meantime doesn't merge into it. Must be called with the page source lock
+ * held.
+ * Arguments:
+ *     PageSource *source - The page source the run belongs to.
+ *     Slab *run - Descriptor of the run's first slab.
+ */
+static void page_unlink_run(PageSource *source, Slab *run) {
+    if(run->prev)
+        run->prev->next = run->next;
+    else
+        source->free_runs[run->block_count] = run->next;
+    if(run->next)
+        run->next->prev = run->prev;
 
-            for(int i = 0; i < BLOCK_CACHE_REFILL_LIMIT; i++) {
-                batch[i]->next = cache->fastbin;
-                cache->fastbin = batch[i];
-                cache->fastbin_count++;
+    source->free_slabs -= run->block_count;
+    source->free_count -= run->free_count;
+    run->free_run = 0;
+    chunk_slab((char *)run->mem + (run->block_count - 1) * SLAB_SIZE)->free_run = 0;
+}
+
+/*
+ * Add a run of slabs to the free runs, merging it with the free runs right before and
+ * after it in the same chunk. The descriptors of a free run's first and last slab are
+ * tagged with its length, so either neighbour is found without a search. The tags are
+ * only touched under the lock, while the owners of the slabs around the run may be
+ * busy with the rest of their descriptors. Must be called with the page source lock
+ * held.
+ * Arguments:
+ *     PageSource *source - The page source the run belongs to.
+ *     char *mem - Start of the run.
+ *     size_t slabs - Length of the run in slabs.
+ *     size_t resident - How many of those slabs are backed by memory.
+ */
+static void page_insert_run(PageSource *source, char *mem, size_t slabs, size_t resident) {
+    char *chunk = (char *)((uintptr_t)mem & ~(uintptr_t)(META_SPAN - 1));
+
+    // The chunk's descriptor slab is never free, so it bounds the merge on the left
+    if(mem - SLAB_SIZE > chunk) {
+        size_t length = chunk_slab(mem - SLAB_SIZE)->free_run;
+        if(length) {
+            Slab *run = chunk_slab(mem - length * SLAB_SIZE);
+            page_unlink_run(source, run);
+            mem = run->mem;
+            slabs += run->block_count;
+            resident += run->free_count;
+        }
+    }
+    if(mem + slabs * SLAB_SIZE < chunk + META_SPAN) {
+        Slab *after = chunk_slab(mem + slabs * SLAB_SIZE);
+        if(after->free_run) {
+            page_unlink_run(source, after);
+            slabs += after->block_count;
+            resident += after->free_count;
+        }
+    }
+
+    Slab *run = chunk_slab(mem);
+    run->mem = mem;
+    run->size_class = SPAN_CLASS;
+    run->block_count = slabs;
+    run->block_size = slabs * SLAB_SIZE;
+    run->free_count = resident;
+    run->node = source->node;
+    run->owner = NULL;
+
+    run->free_run = slabs;
+    chunk_slab(mem + (slabs - 1) * SLAB_SIZE)->free_run = slabs;
+
+    run->prev = NULL;
+    run->next = source->free_runs[slabs];
+    if(run->next)
+        run->next->prev = run;
+    source->free_runs[slabs] = run;
+    source->free_slabs += slabs;
+    source->free_count += resident;
+}
+
+/*
+ * Take a run of slabs from the shortest free run that fits, giving the rest back.
+ * Runs are only tracked as a whole, so a run that was merged from resident and
+ * decommitted parts counts its resident slabs towards the front. Must be called with
+ * the page source lock held.
+ * Arguments:
+ *     PageSource *source - The page source to take from.
+ *     size_t slabs - Number of slabs wanted, at most SPAN_SLABS_MAX.
+ * Returns:
+ *     char * - Start of the run or NULL if no free run is long enough.
+ */
+static char *page_take_run(PageSource *source, size_t slabs) {
+    for(size_t length = slabs; length <= SPAN_SLABS_MAX; length++) {
+        Slab *run = source->free_runs[length];
+        if(!run) continue;
+
+        page_unlink_run(source, run);
+        char *mem = run->mem;
+        if(length > slabs) {
+            size_t resident = run->free_count > slabs ? run->free_count - slabs : 0;
+            chunk_slab(mem + (slabs - 1) * SLAB_SIZE)->free_run = 0;
+            page_insert_run(source, mem + slabs * SLAB_SIZE, length - slabs, resident);
+        }
+        return mem;
+    }
+
+    return NULL;
+}
+
+/*
+ * Carve a run of slabs from the current region, reserving a new region when it runs
+ * out. Runs never straddle chunks, so whatever is left of a chunk too short for the
+ * run becomes a free run. Must be called with the page source lock held.
+ * Arguments:
+ *     PageSource *source - The page source to carve from.
+ *     size_t slabs - Number of slabs wanted, at most SPAN_SLABS_MAX.
+ * Returns:
+ *     char * - Start of the run or NULL on error.
+ */
+static char *page_carve(PageSource *source, size_t slabs) {
+    for(;;) {
+        // Grab a new region if the current one is used up
+        if(source->bump == source->bump_end) {
+            size_t size;
+            char *region = reserve_region(source, &size);
+            if(!region) return NULL;
+            if(page_map_reset(region, size) < 0) {
+                munmap(region, size);
+                return NULL;
             }
 
-            // Pop off top of fastbin
-            block = cache->fastbin;
-            cache->fastbin = block->next;
-            cache->fastbin_count--;
-            return (void *)block;
+            // Remember the region so a heap's source can unmap everything it reserved
+            Slab *head = chunk_slab(region);
+            head->mem = region;
+            head->block_size = size;
+            head->next = source->regions;
+            source->regions = head;
+
+            source->bump = region;
+            source->bump_end = region + size;
+            source->mapped_bytes += size;
         }
 
-        block = slab->free_list;
-        slab->free_list = block->next;
-        slab->free_count--;
+        // The first slab of each chunk is reserved for the chunk's descriptors
+        if(((uintptr_t)source->bump & (META_SPAN - 1)) == 0)
+            source->bump += SLAB_SIZE;
 
-        // If the slab is empty, we will drop to partials in next allocation
-        if(slab->free_count == 0)
-            cache->current_slab = NULL;
+        char *chunk_end = (char *)ALIGN_UP((uintptr_t)source->bump, META_SPAN);
+        size_t left = (chunk_end - source->bump) / SLAB_SIZE;
+        if(left >= slabs) {
+            char *mem = source->bump;
+            source->bump += slabs * SLAB_SIZE;
+            return mem;
+        }
 
-        return (void *)block;
+        // Never touched, so it counts as decommitted until it is used
+        page_insert_run(source, source->bump, left, 0);
+        source->bump = chunk_end;
     }
+}
 
-    // If the current slab head is empty, look and see if there are other slabs in the list that are not
-    Slab *slab = cache->partial_slabs;
-    if(slab) {
-        // Pop head of partial list, set is as current, and go back to fast path
-        cache->partial_slabs = slab->next;
-        cache->current_slab = slab;
+/*
+ * Get slab memory aligned to SLAB_SIZE. Released slabs, spans and chunk tails all end
+ * up in the free runs, merged with their free neighbours, so the shortest free run
+ * that fits is used first and the current region is only carved, and a new region
+ * only reserved, when no free run is long enough.
+ * Arguments:
+ *     PageSource *source - The page source to take the memory from.
+ *     size_t slabs - Length of the memory in SLAB_SIZE units, at most SPAN_SLABS_MAX.
+ * Returns:
+ *     void * - The slab memory or NULL on error.
+ */
+static void *page_alloc_slabs(PageSource *source, size_t slabs) {
+    pthread_mutex_lock(&source->lock);
+    void *mem = page_take_run(source, slabs);
+    if(!mem)
+        mem = page_carve(source, slabs);
+    if(mem)
+        source->slabs_out += slabs;
+    pthread_mutex_unlock(&source->lock);
+
+    return mem;
+}
+
+/*
+ * Hand resident free slabs back to the OS until at most keep of them remain. Whole
+ * runs are decommitted, longest first so it takes as few calls as possible.
+ * Arguments:
+ *     PageSource *source - The page source to shrink.
+ *     size_t keep - Number of resident free slabs to keep.
+ * Returns:
+ *     size_t - Number of resident slabs decommitted.
+ */
+static size_t page_decommit(PageSource *source, size_t keep) {
+    // Detach the surplus under the lock, madvise can take a while
+    pthread_mutex_lock(&source->lock);
+    Slab *surplus = NULL;
+    for(size_t length = SPAN_SLABS_MAX; length > 0 && source->free_count > keep; length--) {
+        Slab *next;
+        for(Slab *run = source->free_runs[length]; run && source->free_count > keep; run = next) {
+            next = run->next;
+            if(!run->free_count) continue;
 
-        return slab_alloc();
+            page_unlink_run(source, run);
+            run->next = surplus;
+            surplus = run;
+        }
     }
+    pthread_mutex_unlock(&source->lock);
 
-    // If the allocation fails, allocate a new slab (slow)
-    slab = allocate_new_slab();
-    if(!slab) return NULL;
+    size_t released = 0;
+    while(surplus) {
+        Slab *run = surplus;
+        surplus = run->next;
+        char *mem = run->mem;
+        size_t slabs = run->block_count;
+        size_t resident = run->free_count;
 
-    // Initialize thread-local slab and free list
-    cache->current_slab = slab;
-    return slab_alloc();
+        // Drop the pages, the descriptors are out of line and survive. Slabs inside
+        // explicit huge pages can't be decommitted on their own and stay resident.
+        if(madvise(mem, slabs * SLAB_SIZE, DECOMMIT_ADVICE) == 0) {
+            released += resident;
+            resident = 0;
+        }
+
+        pthread_mutex_lock(&source->lock);
+        page_insert_run(source, mem, slabs, resident);
+        pthread_mutex_unlock(&source->lock);
+    }
+
+    return released;
 }
 
 /*
- * Free a block back to the allocator. This needs to determine which slab owns the
- * block using pointer arithmetic and give it back to that slab.
+ * Give slab memory back to the page source as a free run. Once more than
+ * PAGE_RETAIN_HIGH free slabs are resident, the surplus is decommitted down to
+ * PAGE_RETAIN_LOW.
  * Arguments:
- *     void *block - The block that was allocated.
+ *     PageSource *source - The page source the memory was taken from.
+ *     void *mem - Memory returned by page_alloc_slabs().
+ *     size_t slabs - Length of the memory in SLAB_SIZE units.
  */
-void slab_free(void *block) {
-    ThreadCache *cache = fast_thread_cache();
-    Block *b = (Block *)block;
-
-    // Fast path: just push to the thread-local block cache
-    if(cache->fastbin_count < BLOCK_CACHE_LIMIT) {
-        b->next = cache->fastbin;
-        cache->fastbin = b;
-        cache->fastbin_count++;
+static void page_free_slabs(PageSource *source, void *mem, size_t slabs) {
+    pthread_mutex_lock(&source->lock);
+    source->slabs_out -= slabs;
+    page_insert_run(source, mem, slabs, slabs);
+    size_t free_count = source->free_count;
+    pthread_mutex_unlock(&source->lock);
+
+    if(free_count > PAGE_RETAIN_HIGH)
+        page_decommit(source, PAGE_RETAIN_LOW);
+}
+
+/*
+ * Get a descriptor for a large mapping. Mappings aren't part of any chunk, so their
+ * descriptors come from SLAB_SIZE batches mapped on demand and recycled after the
+ * mapping is unmapped. Must be called with the page source lock held.
+ * Arguments:
+ *     PageSource *source - The page source the mapping belongs to.
+ * Returns:
+ *     Slab * - A descriptor or NULL on error.
+ */
+static Slab *page_new_descriptor(PageSource *source) {
+    if(!source->descriptors) {
+        Slab *batch = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(batch == MAP_FAILED) return NULL;
+
+        for(size_t i = 0; i < SLAB_SIZE / sizeof(Slab); i++) {
+            batch[i].next = source->descriptors;
+            source->descriptors = &batch[i];
+        }
+    }
+
+    Slab *descriptor = source->descriptors;
+    source->descriptors = descriptor->next;
+    return descriptor;
+}
+
+/*
+ * Unmap a large mapping and recycle its descriptor.
+ * Arguments:
+ *     PageSource *source - The page source the mapping belongs to.
+ *     Slab *span - Descriptor of the mapping, no longer on any list.
+ */
+static void page_unmap(PageSource *source, Slab *span) {
+    page_map_set(span->mem, span->block_size, NULL);
+    munmap(span->mem, span->block_size);
+
+    pthread_mutex_lock(&source->lock);
+    span->next = source->descriptors;
+    source->descriptors = span;
+    pthread_mutex_unlock(&source->lock);
+}
+
+/*
+ * Allocate memory above SLAB_MAX_SIZE. Up to SPAN_SLABS_MAX slabs it is a run of
+ * contiguous slabs from the page source, taken from the free runs like any slab, so
+ * the size is rounded up to whole slabs and every call takes the page source lock.
+ * Larger or more
+ * strictly aligned requests get a mapping of their own, entered into the page map
+ * like any region; recently freed mappings of the same length are reused so buffers
+ * that come and go don't turn into mmap/munmap churn.
+ * Arguments:
+ *     int node - NUMA node whose page source the memory comes from.
+ *     size_t size - Number of bytes requested.
+ *     size_t alignment - Required alignment, a power of two.
+ *     int *zeroed - If not NULL, set to 1 when the memory was never handed out before
+ *                   and so still holds the zeros the OS mapped it with, 0 otherwise.
+ * Returns:
+ *     void * - The memory or NULL on error.
+ */
+static void *span_alloc(int node, size_t size, size_t alignment, int *zeroed) {
+    PageSource *source = &page_sources[node];
+    if(size > SIZE_MAX - SLAB_SIZE - alignment) return NULL;
+
+    // Aligned requests can get here with no size at all, they still need a slab
+    size_t slabs = size ? (size + SLAB_SIZE - 1) / SLAB_SIZE : 1;
+    if(slabs <= SPAN_SLABS_MAX && alignment <= SLAB_SIZE) {
+        // Only memory carved straight from a region is known to be untouched
+        int fresh = 0;
+        pthread_mutex_lock(&source->lock);
+        char *mem = page_take_run(source, slabs);
+        if(!mem && (mem = page_carve(source, slabs)))
+            fresh = 1;
+        if(mem)
+            source->large_bytes += slabs * SLAB_SIZE;
+        pthread_mutex_unlock(&source->lock);
+        if(!mem) return NULL;
+
+        Slab *span = chunk_slab(mem);
+        span->mem = mem;
+        span->size_class = SPAN_CLASS;
+        span->block_count = slabs;
+        span->block_size = slabs * SLAB_SIZE;
+        span->node = source->node;
+        span->owner = NULL;
+
+        // Every unit of the run resolves to the head descriptor, so pointers into the
+        // middle of the span find it too. The page map already covers the region.
+        if(slabs > 1)
+            page_map_set(mem + SLAB_SIZE, (slabs - 1) * SLAB_SIZE, span);
+        if(zeroed)
+            *zeroed = fresh;
+        return mem;
+    }
+
+    // Mappings cover whole slabs so no two allocations ever share a page map entry
+    size_t align = alignment > SLAB_SIZE ? alignment : SLAB_SIZE;
+    size_t length = slabs * SLAB_SIZE;
+
+    Slab *span = NULL;
+    int reused = 0;
+    pthread_mutex_lock(&source->lock);
+    for(Slab **link = &source->mappings; *link; link = &(*link)->next) {
+        Slab *cached = *link;
+        if(cached->block_size == length && ((uintptr_t)cached->mem & (align - 1)) == 0) {
+            span = cached;
+            reused = 1;
+            *link = cached->next;
+            source->mapping_count--;
+            source->mapping_bytes -= length;
+            break;
+        }
+    }
+    if(!span)
+        span = page_new_descriptor(source);
+    pthread_mutex_unlock(&source->lock);
+    if(!span) return NULL;
+
+    if(!reused) {
+        char *mem = reserve_aligned(length, align);
+        if(mem && page_map_set(mem, length, span) < 0) {
+            munmap(mem, length);
+            mem = NULL;
+        }
+        if(!mem) {
+            pthread_mutex_lock(&source->lock);
+            span->next = source->descriptors;
+            source->descriptors = span;
+            pthread_mutex_unlock(&source->lock);
+            return NULL;
+        }
+        bind_to_node(source, mem, length);
+
+        span->mem = mem;
+        span->size_class = SPAN_CLASS;
+        span->block_count = 0;
+        span->block_size = length;
+        span->node = source->node;
+        span->owner = NULL;
+
+        pthread_mutex_lock(&source->lock);
+        source->mapped_bytes += length;
+        pthread_mutex_unlock(&source->lock);
+    }
+
+    pthread_mutex_lock(&source->lock);
+    source->large_bytes += length;
+    pthread_mutex_unlock(&source->lock);
+
+    if(zeroed)
+        *zeroed = !reused;
+    return span->mem;
+}
+
+/*
+ * Free memory handed out by span_alloc(). Spans go back to the free runs, merged with
+ * their free neighbours. Mappings are cached while there is room and unmapped
+ * otherwise.
+ * Arguments:
+ *     Slab *span - Descriptor of the allocation.
+ */
+static void span_free(Slab *span) {
+    PageSource *source = &page_sources[span->node];
+
+    if(span->block_count) {
+        // Hand the tail units their own descriptors back before the run is reused
+        if(span->block_count > 1)
+            page_map_reset((char *)span->mem + SLAB_SIZE, (span->block_count - 1) * SLAB_SIZE);
+
+        pthread_mutex_lock(&source->lock);
+        source->large_bytes -= span->block_size;
+        page_insert_run(source, span->mem, span->block_count, span->block_count);
+        size_t free_count = source->free_count;
+        pthread_mutex_unlock(&source->lock);
+
+        if(free_count > PAGE_RETAIN_HIGH)
+            page_decommit(source, PAGE_RETAIN_LOW);
         return;
     }
 
-    // Get the parent of the block
-    uintptr_t mem_start = (uintptr_t)block & ~(BLOCK_SIZE * BLOCK_COUNT - 1);
-    Slab *parent = *((Slab **)mem_start);
+    size_t length = span->block_size;
 
-    // Add the block to the head of the free_list
-    b->next = parent->free_list;
-    parent->free_list = b;
-    parent->free_count++;
+    pthread_mutex_lock(&source->lock);
+    source->large_bytes -= length;
+    if(source->mapping_count < MAPPING_CACHE_COUNT && length <= MAPPING_CACHE_MAX) {
+        span->next = source->mappings;
+        source->mappings = span;
+        source->mapping_count++;
+        source->mapping_bytes += length;
+        pthread_mutex_unlock(&source->lock);
+        return;
+    }
+    source->mapped_bytes -= length;
+    pthread_mutex_unlock(&source->lock);
 
-    // If we went from full to partial, put it in the partial list
-    if(parent->free_count == 1 && parent != cache->current_slab) {
-        parent->next = cache->partial_slabs;
-        cache->partial_slabs = parent;
+    page_unmap(source, span);
+}
+
+/*
+ * Unmap every large mapping a page source has cached.
+ * Arguments:
+ *     PageSource *source - The page source to flush.
+ * Returns:
+ *     size_t - Number of bytes unmapped.
+ */
+static size_t page_flush_mappings(PageSource *source) {
+    pthread_mutex_lock(&source->lock);
+    Slab *mappings = source->mappings;
+    source->mappings = NULL;
+    source->mapped_bytes -= source->mapping_bytes;
+    source->mapping_count = 0;
+    source->mapping_bytes = 0;
+    pthread_mutex_unlock(&source->lock);
+
+    size_t released = 0;
+    while(mappings) {
+        Slab *span = mappings;
+        mappings = span->next;
+
+        released += span->block_size;
+        page_unmap(source, span);
     }
-}
\ No newline at end of file
+
+    return released;
+}
+
+/*
+ * Find the page source a thread cache's slabs come from.
+ * Arguments:
+ *     ThreadCache *thread - The thread cache.
+ *     int node - NUMA node of the slab memory.
+ * Returns:
+ *     PageSource * - The heap's private source, or the node's source.
+ */
+static inline PageSource *slab_pages(ThreadCache *thread, int node) {
+    if(thread->heap && thread->heap->pages) return thread->heap->pages;
+    return &page_sources[node];
+}
+
+/*
+ * Allocate a new slab. This will be called if the current slab is full.
+ * Arguments:
+ *     ThreadCache *owner - The thread cache that will own the slab.
+ *     size_t size_class - The size class the slab will be carved into.
+ * Returns:
+ *     Slab * - An initialized slab ready for use or NULL on error.
+ */
+static Slab *allocate_new_slab(ThreadCache *owner, size_t size_class) {
+    SlabHeap *heap = owner->heap;
+    size_t block_size = heap ? heap->block_size : size_classes[size_class];
+    size_t slabs = heap ? heap->slab_slabs : 1;
+
+    // Get aligned slab memory from the page source and check for errors
+    void *mem = page_alloc_slabs(slab_pages(owner, owner->node), slabs);
+    if(!mem) return NULL;
+
+    // The descriptor lives out of line, so the whole slab is blocks. Every block stays
+    // aligned to 16 bytes since all classes are multiples of 16.
+    Slab *slab = chunk_slab(mem);
+
+    // A slab longer than SLAB_SIZE is a run of units that all resolve to the first
+    // unit's descriptor. The page map already covers the region, so this can't fail.
+    if(slabs > 1)
+        page_map_set((char *)mem + SLAB_SIZE, (slabs - 1) * SLAB_SIZE, slab);
+
+    // Set slab metadata
+    slab->size_class = size_class;
+    slab->block_size = block_size;
+    slab->block_count = slabs * SLAB_SIZE / block_size;
+    slab->free_count = slab->block_count;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->owner = owner;
+    slab->node = owner->node;
+    slab->remote_next = NULL;
+    atomic_init(&slab->remote_free, 0);
+
+    // Store the slab's memory as the allocated memory
+    slab->mem = mem;
+
+    // Free state lives in the descriptor's bitmap, so setting up a slab never touches
+    // its blocks and only the pages that are actually used ever get faulted in
+    slab->reciprocal = (uint32_t)((1ULL << 32) / block_size + 1);
+    slab->link_offset = heap ? (uint32_t)heap->link_offset : 0;
+    slab->map_hint = 0;
+    size_t full_words = slab->block_count / 64;
+    memset(slab->free_map, 0xff, full_words * sizeof(uint64_t));
+    memset(slab->free_map + full_words, 0, (SLAB_MAP_WORDS - full_words) * sizeof(uint64_t));
+    if(slab->block_count % 64)
+        slab->free_map[full_words] = (1ULL << (slab->block_count % 64)) - 1;
+
+    // Constructed objects are the exception: they are set up once, here, and keep their
+    // state for as long as the slab stays with its cache
+    if(heap && heap->ctor) {
+        for(size_t i = 0; i < slab->block_count; i++)
+            heap->ctor((char *)mem + i * block_size);
+    }
+
+    return slab;
+}
+
+/*
+ * Hand blocks freed by a thread other than the owner back to their slab. The chain is
+ * pushed onto the slab's remote list with a single CAS; the first push after the owner
+ * last drained the slab also queues the slab on the owner so it knows where to look.
+ * Arguments:
+ *     Slab *slab - The slab that owns the blocks.
+ *     Block *first - First block of the chain being freed.
+ *     Block *last - Last block of the chain, first itself for a single block.
+ */
+static void remote_free(Slab *slab, Block *first, Block *last) {
+    uintptr_t head = atomic_load_explicit(&slab->remote_free, memory_order_relaxed);
+    do {
+        last->next = (Block *)(head & ~REMOTE_QUEUED);
+    } while(!atomic_compare_exchange_weak_explicit(&slab->remote_free, &head, (uintptr_t)first | REMOTE_QUEUED,
+                                                   memory_order_acq_rel, memory_order_relaxed));
+
+    // Someone else already queued the slab, the owner will see our blocks when it drains
+    if(head & REMOTE_QUEUED) return;
+
+    // Push the slab onto the owner's list of slabs with pending remote frees. The slab
+    // can't be released while the tag is set, so touching it here is safe.
+    ThreadCache *owner = slab->owner;
+    Slab *top = atomic_load_explicit(&owner->remote_slabs, memory_order_relaxed);
+    do {
+        slab->remote_next = top;
+    } while(!atomic_compare_exchange_weak_explicit(&owner->remote_slabs, &top, slab,
+                                                   memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * Push a slab onto the front of a doubly linked slab list.
+ * Arguments:
+ *     Slab **list - Head of the list.
+ *     Slab *slab - The slab.
+ */
+static inline void slab_list_push(Slab **list, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if(slab->next)
+        slab->next->prev = slab;
+    *list = slab;
+}
+
+/*
+ * Unlink a slab from anywhere in a doubly linked slab list.
+ * Arguments:
+ *     Slab **list - Head of the list.
+ *     Slab *slab - A slab on the list.
+ */
+static inline void slab_list_remove(Slab **list, Slab *slab) {
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if(slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/*
+ * Push a slab onto the front of a class's partial list.
+ * Arguments:
+ *     ClassCache *cache - The class cache owning the list.
+ *     Slab *slab - The slab that just got free blocks.
+ */
+static inline void partial_push(ClassCache *cache, Slab *slab) {
+    slab_list_push(&cache->partial_slabs, slab);
+}
+
+/*
+ * Unlink a slab from anywhere in a class's partial list.
+ * Arguments:
+ *     ClassCache *cache - The class cache owning the list.
+ *     Slab *slab - A slab on the partial list.
+ */
+static inline void partial_remove(ClassCache *cache, Slab *slab) {
+    slab_list_remove(&cache->partial_slabs, slab);
+}
+
+/*
+ * Release a slab's memory. Only called once every block is back in the slab. Objects
+ * of an object cache are destructed on the way out.
+ * Arguments:
+ *     Slab *slab - The fully free slab.
+ */
+static void release_slab(Slab *slab) {
+    SlabHeap *heap = slab->owner->heap;
+    if(heap && heap->dtor) {
+        for(size_t i = 0; i < slab->block_count; i++)
+            heap->dtor((char *)slab->mem + i * slab->block_size);
+    }
+
+    size_t slabs = heap ? heap->slab_slabs : 1;
+    if(slabs > 1)
+        page_map_reset((char *)slab->mem + SLAB_SIZE, (slabs - 1) * SLAB_SIZE);
+    page_free_slabs(slab_pages(slab->owner, slab->node), slab->mem, slabs);
+}
+
+/*
+ * Called when the last block of a slab comes home. A few fully free slabs stay on the
+ * partial list so a thread hovering around a slab boundary doesn't churn the page
+ * source; past THREAD_EMPTY_SLABS (or the heap's own limit) they are released.
+ * Arguments:
+ *     ClassCache *cache - The class cache owning the slab.
+ *     Slab *slab - The slab that just became fully free.
+ */
+static void slab_emptied(ClassCache *cache, Slab *slab) {
+    // The current slab will be allocated from again soon
+    if(slab == cache->current_slab) return;
+
+    size_t retain = slab->owner->heap ? slab->owner->heap->empty_slabs : THREAD_EMPTY_SLABS;
+    if(cache->empty_count < retain) {
+        cache->empty_count++;
+        return;
+    }
+
+    partial_remove(cache, slab);
+    STAT_ADD(slab->owner->stats.slabs_released, 1);
+    release_slab(slab);
+}
+
+/*
+ * Give a chain of blocks back to a slab owned by the calling thread by setting their
+ * bits in the slab's free map.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache, which owns the slab.
+ *     Slab *slab - The slab that owns the blocks.
+ *     Block *blocks - NULL terminated chain of blocks being returned.
+ * Returns:
+ *     size_t - Number of blocks returned.
+ */
+static size_t slab_push_blocks(ThreadCache *thread, Slab *slab, Block *blocks) {
+    ClassCache *cache = &thread->classes[slab->size_class];
+
+    size_t count = 0;
+    while(blocks) {
+        // Block sizes aren't powers of two, a multiply by the reciprocal stands in for the division
+        uint64_t offset = (uintptr_t)blocks - (uintptr_t)slab->mem;
+        size_t index = (offset * slab->reciprocal) >> 32;
+        size_t word = index / 64;
+
+        slab->free_map[word] |= 1ULL << (index % 64);
+        if(word < slab->map_hint)
+            slab->map_hint = word;
+
+        blocks = blocks->next;
+        count++;
+    }
+
+    // Slabs of a node the thread has left are parked rather than allocated from, and
+    // go back to the page source as soon as they are free
+    if(__builtin_expect(slab->node != thread->node, 0)) {
+        if(slab->free_count == 0)
+            slab_list_push(&thread->parked_slabs, slab);
+        slab->free_count += count;
+
+        if(slab->free_count == slab->block_count) {
+            slab_list_remove(&thread->parked_slabs, slab);
+            STAT_ADD(thread->stats.slabs_released, 1);
+            release_slab(slab);
+        }
+        return count;
+    }
+
+    // If we went from full to partial, put it in the partial list
+    if(slab->free_count == 0 && slab != cache->current_slab)
+        partial_push(cache, slab);
+    slab->free_count += count;
+
+    if(slab->free_count == slab->block_count)
+        slab_emptied(cache, slab);
+
+    return count;
+}
+
+/*
+ * Move every block other threads have freed into the owning slabs' free maps. Slabs
+ * that were full become partial again.
+ * Arguments:
+ *     ThreadCache *cache - The calling thread's cache.
+ */
+static void drain_remote_frees(ThreadCache *cache) {
+    Slab *slab = atomic_exchange_explicit(&cache->remote_slabs, NULL, memory_order_acquire);
+    while(slab) {
+        // Read the link before clearing the tag, after that another thread may requeue the slab
+        Slab *next = slab->remote_next;
+        uintptr_t head = atomic_exchange_explicit(&slab->remote_free, 0, memory_order_acq_rel);
+        Block *blocks = (Block *)(head & ~REMOTE_QUEUED);
+
+        if(blocks) {
+            size_t count = slab_push_blocks(cache, slab, blocks);
+            STAT_ADD(cache->stats.remote_drained, count);
+        }
+
+        slab = next;
+    }
+}
+
+/*
+ * Return every block of a magazine to its slab. Blocks are grouped by slab first so
+ * each slab header is touched once per spill rather than once per block. Magazines
+ * handed out by the depot can hold blocks of other threads, so each group goes back
+ * through its slab's owner.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     void **rounds - The magazine's blocks.
+ *     size_t count - Number of blocks in rounds, at most SLAB_MAGAZINE_SIZE.
+ */
+static void spill_magazine(ThreadCache *thread, void **rounds, size_t count) {
+    struct {
+        Slab *slab;
+        Block *first;
+        Block *last;
+        size_t count;
+    } groups[SLAB_MAGAZINE_SIZE];
+
+    // Sort the blocks into per-slab chains
+    int group_count = 0;
+    for(size_t i = 0; i < count; i++) {
+        Slab *slab = slab_of(rounds[i]);
+        Block *block = block_link(slab, rounds[i]);
+
+        // Neighbouring blocks usually share a slab, so search the newest group first
+        int g = group_count - 1;
+        while(g >= 0 && groups[g].slab != slab)
+            g--;
+
+        if(g < 0) {
+            g = group_count++;
+            groups[g].slab = slab;
+            groups[g].last = block;
+            groups[g].count = 0;
+            block->next = NULL;
+        } else {
+            block->next = groups[g].first;
+        }
+        groups[g].first = block;
+        groups[g].count++;
+    }
+
+    for(int g = 0; g < group_count; g++) {
+        Slab *slab = groups[g].slab;
+        if(slab->owner == thread) {
+            slab_push_blocks(thread, slab, groups[g].first);
+        } else {
+            remote_free(slab, groups[g].first, groups[g].last);
+            STAT_ADD(thread->stats.remote_frees, groups[g].count);
+        }
+    }
+}
+
+/*
+ * Release every fully free slab on a class's partial list.
+ * Arguments:
+ *     ClassCache *cache - The class cache to scan.
+ * Returns:
+ *     size_t - Number of slabs released.
+ */
+static size_t release_empty_slabs(ClassCache *cache) {
+    size_t released = 0;
+
+    Slab *slab = cache->partial_slabs;
+    while(slab) {
+        Slab *next = slab->next;
+
+        if(slab->free_count == slab->block_count) {
+            partial_remove(cache, slab);
+            STAT_ADD(slab->owner->stats.slabs_released, 1);
+            release_slab(slab);
+            released++;
+        }
+
+        slab = next;
+    }
+    cache->empty_count = 0;
+
+    return released;
+}
+
+/*
+ * Strip a thread cache down to its slabs. Cached blocks go back to their slabs and
+ * fully free slabs are released. Slabs that still have blocks out (in other threads,
+ * the depot, or on their way back through the remote free lists) stay attached to
+ * the cache.
+ * Arguments:
+ *     ThreadCache *cache - The thread cache, no longer used by any thread.
+ */
+static void retire_thread_cache(ThreadCache *cache) {
+    // Empty both magazines of every class back into the slabs
+    for(size_t i = 0; i < cache->class_count; i++) {
+        ClassCache *cc = &cache->classes[i];
+
+        spill_magazine(cache, cc->fastbin, cc->fastbin_count);
+        spill_magazine(cache, cc->previous, cc->previous_count);
+        cc->fastbin_count = 0;
+        cc->previous_count = 0;
+    }
+
+    // Pick up whatever other threads have already handed back
+    drain_remote_frees(cache);
+
+    for(size_t i = 0; i < cache->class_count; i++) {
+        ClassCache *cc = &cache->classes[i];
+
+        // Fold the current slab into the partial list so both are handled alike
+        Slab *slab = cc->current_slab;
+        cc->current_slab = NULL;
+        if(slab && slab->free_count)
+            partial_push(cc, slab);
+
+        // Release fully free slabs and keep the rest
+        release_empty_slabs(cc);
+    }
+}
+
+/*
+ * Tear down a thread's cache when the thread exits. The cache is retired and parked,
+ * remaining slabs included, on the orphan list for the next new thread to adopt.
+ * Arguments:
+ *     void *arg - Pointer to the thread cache.
+ */
+static void slab_thread_destructor(void *arg) {
+    ThreadCache *cache = (ThreadCache *)arg;
+    if(!cache) return;
+
+    retire_thread_cache(cache);
+
+    // Any allocation made by later destructors gets a fresh cache
+    thread_cache = NULL;
+
+    // Park the cache, full and partial slabs included, for the next thread
+    pthread_mutex_lock(&cache_lock);
+    cache->next_orphan = orphans;
+    orphans = cache;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Take a full magazine from the depot.
+ * Arguments:
+ *     int node - NUMA node whose depot to use.
+ *     size_t size_class - Size class of the magazine.
+ *     void **rounds - Receives exactly SLAB_MAGAZINE_SIZE blocks.
+ * Returns:
+ *     int - 1 if a magazine was taken, 0 if the depot is empty.
+ */
+static int depot_get(int node, size_t size_class, void **rounds) {
+    Depot *depot = &depots[node][size_class];
+    int taken = 0;
+
+    // Peek without the lock so an empty depot costs a single load
+    if(!atomic_load_explicit(&depot->count, memory_order_relaxed)) return 0;
+
+    pthread_mutex_lock(&depot->lock);
+    size_t count = atomic_load_explicit(&depot->count, memory_order_relaxed);
+    if(count) {
+        memcpy(rounds, depot->full[count - 1].rounds, sizeof(Magazine));
+        atomic_store_explicit(&depot->count, count - 1, memory_order_relaxed);
+        taken = 1;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    return taken;
+}
+
+/*
+ * Hand a full magazine to the depot so another thread can allocate from it.
+ * Arguments:
+ *     int node - NUMA node whose depot to use.
+ *     size_t size_class - Size class of the magazine.
+ *     void **rounds - Exactly SLAB_MAGAZINE_SIZE blocks.
+ * Returns:
+ *     int - 1 if the depot took the magazine, 0 if the depot is at DEPOT_LIMIT.
+ */
+static int depot_put(int node, size_t size_class, void **rounds) {
+    Depot *depot = &depots[node][size_class];
+    int stored = 0;
+
+    pthread_mutex_lock(&depot->lock);
+    size_t count = atomic_load_explicit(&depot->count, memory_order_relaxed);
+    if(count < DEPOT_LIMIT) {
+        memcpy(depot->full[count].rounds, rounds, sizeof(Magazine));
+        atomic_store_explicit(&depot->count, count + 1, memory_order_relaxed);
+        stored = 1;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    return stored;
+}
+
+/*
+ * Find a slab with free blocks to refill from: blocks freed by other threads first,
+ * then the partial list, and finally a brand new slab.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     size_t size_class - Index of the size class to allocate from.
+ * Returns:
+ *     Slab * - The new current slab or NULL on error.
+ */
+static Slab *next_slab(ThreadCache *thread, size_t size_class) {
+    ClassCache *cache = &thread->classes[size_class];
+
+    // Collect blocks other threads handed back before looking for another slab
+    if(atomic_load_explicit(&thread->remote_slabs, memory_order_relaxed)) {
+        drain_remote_frees(thread);
+        if(cache->current_slab && cache->current_slab->free_count)
+            return cache->current_slab;
+    }
+
+    // If the current slab head is empty, look and see if there are other slabs in the list that are not
+    Slab *slab = cache->partial_slabs;
+    if(slab) {
+        // Pop head of partial list and set it as current
+        partial_remove(cache, slab);
+        if(slab->free_count == slab->block_count)
+            cache->empty_count--;
+        STAT_ADD(thread->stats.partial_pops, 1);
+    } else {
+        // If there are no partial slabs, allocate a new slab (slow)
+        slab = allocate_new_slab(thread, size_class);
+        if(!slab) return NULL;
+        STAT_ADD(thread->stats.new_slabs, 1);
+    }
+
+    cache->current_slab = slab;
+    return slab;
+}
+
+/*
+ * Take free blocks straight out of the thread's slabs, moving on to the next slab as
+ * each one runs dry. Only the bitmaps are scanned, the blocks themselves are never
+ * touched.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     size_t size_class - Index of the size class to allocate from.
+ *     void **out - Receives the blocks, to be handed out from the top like a magazine.
+ *     size_t want - Number of blocks wanted.
+ * Returns:
+ *     size_t - Number of blocks stored in out, less than want only if memory ran out.
+ */
+static size_t carve_blocks(ThreadCache *thread, size_t size_class, void **out, size_t want) {
+    ClassCache *cache = &thread->classes[size_class];
+    size_t count = 0;
+
+    while(count < want) {
+        Slab *slab = cache->current_slab;
+        if(!slab || !slab->free_count) {
+            slab = next_slab(thread, size_class);
+            if(!slab) break;
+        }
+
+        // Detach as many blocks as are still needed in one run
+        size_t take = want - count;
+        if(take > slab->free_count)
+            take = slab->free_count;
+
+        slab->free_count -= take;
+        count += take;
+
+        // Claim free slots lowest address first, so untouched memory stays untouched for
+        // as long as possible. Blocks are handed out from the top, so fill top down.
+        void **top = out + count;
+        while(take) {
+            uint64_t bits = slab->free_map[slab->map_hint];
+            if(!bits) {
+                slab->map_hint++;
+                continue;
+            }
+
+            char *base = (char *)slab->mem + slab->map_hint * 64 * slab->block_size;
+            do {
+                *--top = base + __builtin_ctzll(bits) * slab->block_size;
+                bits &= bits - 1;
+            } while(--take && bits);
+
+            slab->free_map[slab->map_hint] = bits;
+        }
+
+        // If the slab is empty, we will drop to partials on the next refill
+        if(slab->free_count == 0)
+            cache->current_slab = NULL;
+    }
+
+    return count;
+}
+
+/*
+ * Load a full magazine straight from the thread's slabs.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     size_t size_class - Index of the size class to allocate from.
+ */
+static void refill_magazine(ThreadCache *thread, size_t size_class) {
+    ClassCache *cache = &thread->classes[size_class];
+    STAT_ADD(thread->stats.slab_refills, 1);
+
+    cache->fastbin_count += carve_blocks(thread, size_class, cache->fastbin + cache->fastbin_count,
+                                         thread->magazine_size - cache->fastbin_count);
+}
+
+/*
+ * Move a thread cache to another node, after the thread migrated or when a cache is
+ * taken over by a thread elsewhere. The magazines hold memory from the old node, so
+ * they are emptied back into their slabs. The old node's slabs then come off the
+ * class lists, free ones are released and the rest are parked until their blocks come
+ * home, so refills carve new-node slabs. Slabs parked on an earlier stay on the new
+ * node are taken back.
+ * Arguments:
+ *     ThreadCache *thread - The cache, used by the calling thread only.
+ *     int node - The node the cache moves to.
+ */
+static void move_to_node(ThreadCache *thread, int node) {
+    if(node == thread->node) return;
+
+    for(size_t i = 0; i < thread->class_count; i++) {
+        ClassCache *cc = &thread->classes[i];
+
+        spill_magazine(thread, cc->fastbin, cc->fastbin_count);
+        spill_magazine(thread, cc->previous, cc->previous_count);
+        cc->fastbin_count = 0;
+        cc->previous_count = 0;
+
+        // Fold the current slab into the partial list so both are handled alike
+        Slab *slab = cc->current_slab;
+        cc->current_slab = NULL;
+        if(slab && slab->free_count)
+            partial_push(cc, slab);
+    }
+
+    thread->node = node;
+
+    for(size_t i = 0; i < thread->class_count; i++) {
+        ClassCache *cc = &thread->classes[i];
+
+        Slab *slab = cc->partial_slabs;
+        while(slab) {
+            Slab *next = slab->next;
+
+            if(slab->free_count == slab->block_count) {
+                partial_remove(cc, slab);
+                STAT_ADD(thread->stats.slabs_released, 1);
+                release_slab(slab);
+            } else if(slab->node != node) {
+                partial_remove(cc, slab);
+                slab_list_push(&thread->parked_slabs, slab);
+            }
+
+            slab = next;
+        }
+        cc->empty_count = 0;
+    }
+
+    Slab *slab = thread->parked_slabs;
+    while(slab) {
+        Slab *next = slab->next;
+
+        if(slab->node == node) {
+            slab_list_remove(&thread->parked_slabs, slab);
+            partial_push(&thread->classes[slab->size_class], slab);
+        }
+
+        slab = next;
+    }
+}
+
+/*
+ * Prefetch the block the loaded magazine will hand out next. Blocks that sat in a
+ * magazine or were never used are usually cold, and the caller is likely to write to
+ * them right away, so the miss is started one allocation early.
+ * Arguments:
+ *     ClassCache *cache - The class cache that just handed out a block.
+ */
+static inline void prefetch_next(ClassCache *cache) {
+    int mode = atomic_load_explicit(&prefetch_mode, memory_order_relaxed);
+    if(__builtin_expect(mode == SLAB_PREFETCH_NONE || !cache->fastbin_count, 1)) return;
+
+    void *next = cache->fastbin[cache->fastbin_count - 1];
+    if(mode == SLAB_PREFETCH_WRITE)
+        __builtin_prefetch(next, 1, 3);
+    else
+        __builtin_prefetch(next, 0, 3);
+}
+
+/*
+ * Allocate a block of one size class once the loaded magazine is empty. Swap in the
+ * previous magazine if it is full, then try the depot, and only then go to the slabs.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     size_t size_class - Index of the size class to allocate from.
+ * Returns:
+ *      void * - A block of memory for the thread to use or NULL on empty.
+ */
+static void *class_alloc_slow(ThreadCache *thread, size_t size_class) {
+    ClassCache *cache = &thread->classes[size_class];
+
+    // Follow the thread if the scheduler moved it to another node
+    if(numa_nodes > 1)
+        move_to_node(thread, current_node());
+
+    if(cache->previous_count) {
+        // The previous magazine is full, swap it in
+        memcpy(cache->fastbin, cache->previous, sizeof(cache->previous));
+        cache->fastbin_count = cache->previous_count;
+        cache->previous_count = 0;
+    } else if(!thread->heap && depot_get(thread->node, size_class, cache->fastbin)) {
+        // Another thread left a full magazine behind
+        cache->fastbin_count = SLAB_MAGAZINE_SIZE;
+        STAT_ADD(thread->stats.depot_gets, 1);
+    } else {
+        // Nobody has spare blocks, carve a magazine out of our slabs
+        refill_magazine(thread, size_class);
+        if(!cache->fastbin_count) return NULL;
+    }
+
+    void *block = cache->fastbin[--cache->fastbin_count];
+    prefetch_next(cache);
+    return block;
+}
+
+/*
+ * Allocate a block of one size class. Try to allocate from the thread's magazines first
+ * and fall back to the depot and the thread's slabs.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     size_t size_class - Index of the size class to allocate from.
+ * Returns:
+ *      void * - A block of memory for the thread to use or NULL on empty.
+ */
+static inline void *class_alloc(ThreadCache *thread, size_t size_class) {
+    ClassCache *cache = &thread->classes[size_class];
+
+    // Try to allocate from the loaded magazine (fastest)
+    if(__builtin_expect(cache->fastbin_count != 0, 1)) {
+        void *block = cache->fastbin[--cache->fastbin_count];
+        prefetch_next(cache);
+        STAT_ADD(thread->stats.fastbin_hits, 1);
+        return block;
+    }
+
+    return class_alloc_slow(thread, size_class);
+}
+
+#if HAVE_RSEQ
+// Blocks cached by one CPU for one size class. The count doubles as the commit point
+// of every restartable sequence that touches the record.
+typedef struct cpuclass {
+    size_t count;                       // Number of cached blocks.
+    void *slots[PERCPU_SLOTS];          // Stack of cached blocks.
+} CpuClass;
+
+// Everything one CPU caches, laid out at a fixed stride so the CPU number maps to it
+// with a shift inside the critical section.
+typedef struct cpucache {
+    CpuClass classes[SLAB_SIZE_CLASSES];
+} CpuCache;
+
+_Static_assert(sizeof(CpuCache) <= (1 << PERCPU_SHIFT), "CpuCache outgrew PERCPU_SHIFT");
+
+static char *percpu_caches = NULL;                          // One CpuCache per possible CPU, 1 << PERCPU_SHIFT apart.
+static int percpu_cpus = 0;                                 // Number of CpuCaches in percpu_caches.
+static _Atomic int percpu_active = 0;                       // Whether slab_alloc/slab_free go through the CPU caches.
+static _Atomic unsigned percpu_generation = 0;              // Bumped every time the CPU caches are turned on.
+static pthread_mutex_t percpu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Locate the calling thread's rseq area, registered by glibc.
+ * Returns:
+ *     struct rseq * - The thread's rseq area.
+ */
+static inline struct rseq *rseq_area() {
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/*
+ * Pop a block from the current CPU's cache inside a restartable sequence. If the
+ * thread is preempted or migrated before the count is stored, the kernel restarts
+ * the sequence, so no atomics are needed.
+ * Arguments:
+ *     size_t size_class - Size class to pop from.
+ * Returns:
+ *     void * - A cached block or NULL if the CPU's cache is empty.
+ */
+static inline void *percpu_pop(size_t size_class) {
+    uintptr_t record, count;
+    void *block;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n"
+        ".balign 32\n"
+        ".Lpop_cs_%=:\n"
+        ".long 0, 0\n"
+        ".quad .Lpop_start_%=, .Lpop_commit_%= - .Lpop_start_%=, .Lpop_abort_%=\n"
+        ".popsection\n"
+        ".Lpop_retry_%=:\n"
+        "leaq .Lpop_cs_%=(%%rip), %[record]\n"
+        "movq %[record], 8(%[rseq])\n"
+        ".Lpop_start_%=:\n"
+        "movl 4(%[rseq]), %k[record]\n"
+        "shlq %[shift], %[record]\n"
+        "addq %[base], %[record]\n"
+        "addq %[offset], %[record]\n"
+        "movq (%[record]), %[count]\n"
+        "testq %[count], %[count]\n"
+        "jz .Lpop_empty_%=\n"
+        "movq (%[record], %[count], 8), %[block]\n"
+        "decq %[count]\n"
+        "movq %[count], (%[record])\n"
+        ".Lpop_commit_%=:\n"
+        "jmp .Lpop_done_%=\n"
+        ".Lpop_empty_%=:\n"
+        "xorl %k[block], %k[block]\n"
+        "jmp .Lpop_done_%=\n"
+        ".pushsection __rseq_failure, \"ax\"\n"
+        ".byte 0x0f, 0xb9, 0x3d\n"
+        ".long %c[sig]\n"
+        ".Lpop_abort_%=:\n"
+        "jmp .Lpop_retry_%=\n"
+        ".popsection\n"
+        ".Lpop_done_%=:\n"
+        : [record] "=&r"(record), [count] "=&r"(count), [block] "=&r"(block)
+        : [rseq] "r"(rseq_area()), [base] "r"(percpu_caches),
+          [offset] "r"(size_class * sizeof(CpuClass)), [shift] "i"(PERCPU_SHIFT), [sig] "i"(RSEQ_SIG)
+        : "memory", "cc");
+
+    return block;
+}
+
+/*
+ * Push a block onto the current CPU's cache inside a restartable sequence.
+ * Arguments:
+ *     size_t size_class - Size class to push to.
+ *     void *block - The block to cache.
+ * Returns:
+ *     int - 1 if the block was cached, 0 if the CPU's cache is full.
+ */
+static inline int percpu_push(size_t size_class, void *block) {
+    uintptr_t record, count;
+    int pushed;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n"
+        ".balign 32\n"
+        ".Lpush_cs_%=:\n"
+        ".long 0, 0\n"
+        ".quad .Lpush_start_%=, .Lpush_commit_%= - .Lpush_start_%=, .Lpush_abort_%=\n"
+        ".popsection\n"
+        ".Lpush_retry_%=:\n"
+        "leaq .Lpush_cs_%=(%%rip), %[record]\n"
+        "movq %[record], 8(%[rseq])\n"
+        ".Lpush_start_%=:\n"
+        "movl 4(%[rseq]), %k[record]\n"
+        "shlq %[shift], %[record]\n"
+        "addq %[base], %[record]\n"
+        "addq %[offset], %[record]\n"
+        "movq (%[record]), %[count]\n"
+        "cmpq %[capacity], %[count]\n"
+        "jae .Lpush_full_%=\n"
+        "movq %[block], 8(%[record], %[count], 8)\n"
+        "incq %[count]\n"
+        "movq %[count], (%[record])\n"
+        ".Lpush_commit_%=:\n"
+        "movl $1, %[pushed]\n"
+        "jmp .Lpush_done_%=\n"
+        ".Lpush_full_%=:\n"
+        "xorl %[pushed], %[pushed]\n"
+        "jmp .Lpush_done_%=\n"
+        ".pushsection __rseq_failure, \"ax\"\n"
+        ".byte 0x0f, 0xb9, 0x3d\n"
+        ".long %c[sig]\n"
+        ".Lpush_abort_%=:\n"
+        "jmp .Lpush_retry_%=\n"
+        ".popsection\n"
+        ".Lpush_done_%=:\n"
+        : [record] "=&r"(record), [count] "=&r"(count), [pushed] "=&r"(pushed)
+        : [rseq] "r"(rseq_area()), [base] "r"(percpu_caches), [block] "r"(block),
+          [offset] "r"(size_class * sizeof(CpuClass)), [shift] "i"(PERCPU_SHIFT),
+          [capacity] "i"(PERCPU_SLOTS), [sig] "i"(RSEQ_SIG)
+        : "memory", "cc");
+
+    return pushed;
+}
+
+/*
+ * Empty a thread's magazines once the CPU caches have been turned on, since nothing
+ * allocates from them any more. Full magazines go to the depot, where the next CPU
+ * cache miss picks them up, the rest goes back to the slabs. Other threads' magazines
+ * can't be touched, so every thread does this for itself on its next trip down a
+ * CPU cache slow path.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ */
+static void percpu_catch_up(ThreadCache *thread) {
+    thread->percpu_generation = atomic_load_explicit(&percpu_generation, memory_order_relaxed);
+
+    for(size_t i = 0; i < SLAB_SIZE_CLASSES; i++) {
+        ClassCache *cc = &thread->classes[i];
+
+        if(cc->fastbin_count == SLAB_MAGAZINE_SIZE && depot_put(thread->node, i, cc->fastbin)) {
+            cc->fastbin_count = 0;
+            STAT_ADD(thread->stats.depot_puts, 1);
+        }
+        if(cc->previous_count == SLAB_MAGAZINE_SIZE && depot_put(thread->node, i, cc->previous)) {
+            cc->previous_count = 0;
+            STAT_ADD(thread->stats.depot_puts, 1);
+        }
+
+        spill_magazine(thread, cc->fastbin, cc->fastbin_count);
+        spill_magazine(thread, cc->previous, cc->previous_count);
+        cc->fastbin_count = 0;
+        cc->previous_count = 0;
+    }
+}
+
+/*
+ * Refill the current CPU's cache and allocate a block. A full magazine comes from the
+ * depot if there is one, otherwise a batch is carved straight out of the thread's
+ * slabs; either way nothing is left behind in the thread's magazines.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     size_t size_class - Size class to allocate from.
+ * Returns:
+ *     void * - A block of memory or NULL on empty.
+ */
+static void *percpu_alloc_slow(ThreadCache *thread, size_t size_class) {
+    STAT_ADD(thread->stats.percpu_misses, 1);
+    if(thread->percpu_generation != atomic_load_explicit(&percpu_generation, memory_order_relaxed))
+        percpu_catch_up(thread);
+
+    // Follow the thread if the scheduler moved it to another node
+    if(numa_nodes > 1)
+        move_to_node(thread, current_node());
+
+    void *rounds[SLAB_MAGAZINE_SIZE];
+    size_t count;
+    if(depot_get(thread->node, size_class, rounds)) {
+        count = SLAB_MAGAZINE_SIZE;
+        STAT_ADD(thread->stats.depot_gets, 1);
+    } else {
+        count = carve_blocks(thread, size_class, rounds, PERCPU_BATCH + 1);
+        if(!count) return NULL;
+        STAT_ADD(thread->stats.slab_refills, 1);
+    }
+
+    // Keep the top block for the caller and cache the rest so the next one out is on
+    // top. Another thread on this CPU may have filled the cache in the meantime, what
+    // doesn't fit goes back to the slabs.
+    void *block = rounds[--count];
+    size_t cached = 0;
+    while(cached < count && percpu_push(size_class, rounds[cached]))
+        cached++;
+    if(cached < count)
+        spill_magazine(thread, rounds + cached, count - cached);
+
+    STAT_ADD(thread->stats.allocs[size_class], 1);
+    return block;
+}
+
+/*
+ * Make room in the current CPU's cache by handing a batch back to the slabs, then
+ * cache the block.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     Slab *parent - The slab that owns the block.
+ *     Block *block - The block being freed.
+ */
+static void percpu_free_slow(ThreadCache *thread, Slab *parent, Block *block) {
+    STAT_ADD(thread->stats.percpu_overflows, 1);
+    if(thread->percpu_generation != atomic_load_explicit(&percpu_generation, memory_order_relaxed))
+        percpu_catch_up(thread);
+
+    void *rounds[PERCPU_BATCH + 1];
+    size_t count = 0;
+    while(count < PERCPU_BATCH && (rounds[count] = percpu_pop(parent->size_class)))
+        count++;
+
+    if(!percpu_push(parent->size_class, block))
+        rounds[count++] = block;
+
+    spill_magazine(thread, rounds, count);
+}
+
+/*
+ * Body of the thread percpu_flush() starts. Only code running on a CPU may touch its
+ * cache, so it visits each CPU in turn and pops the records there, which keeps the
+ * restartable sequences of other threads on that CPU safe. The blocks go back through
+ * the cache of the thread waiting for it.
+ * Arguments:
+ *     void *arg - The waiting thread's cache.
+ * Returns:
+ *     void * - NULL.
+ */
+static void *percpu_flush_thread(void *arg) {
+    ThreadCache *thread = (ThreadCache *)arg;
+    size_t set_size = CPU_ALLOC_SIZE(percpu_cpus);
+    cpu_set_t *one = CPU_ALLOC(percpu_cpus);
+    if(!one) return NULL;
+
+    for(int cpu = 0; cpu < percpu_cpus; cpu++) {
+        // A CPU we can't run on is one no thread of ours ran on either
+        CPU_ZERO_S(set_size, one);
+        CPU_SET_S(cpu, set_size, one);
+        if(sched_setaffinity(0, set_size, one) != 0) continue;
+
+        for(size_t i = 0; i < SLAB_SIZE_CLASSES; i++) {
+            void *rounds[SLAB_MAGAZINE_SIZE];
+            size_t count;
+            do {
+                count = 0;
+                while(count < SLAB_MAGAZINE_SIZE && (rounds[count] = percpu_pop(i)))
+                    count++;
+                spill_magazine(thread, rounds, count);
+            } while(count == SLAB_MAGAZINE_SIZE);
+        }
+    }
+
+    CPU_FREE(one);
+    return NULL;
+}
+
+/*
+ * Empty every CPU's cache back into the slabs. The CPUs are visited by a short lived
+ * thread, so the caller's affinity is never touched; it waits, and its cache takes
+ * the blocks. If the thread can't be started the blocks stay where they are, to be
+ * used again once the CPU caches are turned back on. Must be called with percpu_lock
+ * held, after the CPU caches have been turned off.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ */
+static void percpu_flush(ThreadCache *thread) {
+    pthread_t flusher;
+    if(pthread_create(&flusher, NULL, percpu_flush_thread, thread) == 0)
+        pthread_join(flusher, NULL);
+}
+#endif
+
+/*
+ * Allocate a block of one size class from the CPU caches when they are on, and from
+ * the calling thread's cache otherwise.
+ * Arguments:
+ *     size_t size_class - Index of the size class to allocate from.
+ * Returns:
+ *      void * - A block of memory for the thread to use or NULL on empty.
+ */
+static inline void *cache_alloc(size_t size_class) {
+    ThreadCache *thread = fast_thread_cache();
+    if(__builtin_expect(thread == NULL, 0)) return NULL;
+
+#if HAVE_RSEQ
+    if(atomic_load_explicit(&percpu_active, memory_order_acquire)) {
+        void *block = percpu_pop(size_class);
+        if(__builtin_expect(block == NULL, 0))
+            return percpu_alloc_slow(thread, size_class);
+
+        STAT_ADD(thread->stats.allocs[size_class], 1);
+        STAT_ADD(thread->stats.percpu_hits, 1);
+        return block;
+    }
+#endif
+
+    void *block = class_alloc(thread, size_class);
+    if(__builtin_expect(block != NULL, 1))
+        STAT_ADD(thread->stats.allocs[size_class], 1);
+    return block;
+}
+
+/*
+ * Allocate a BLOCK_SIZE block from the slab allocator.
+ * Returns:
+ *      void * - A block of memory for the thread to use or NULL on empty.
+ */
+void *slab_alloc() {
+    return cache_alloc(size_to_class(BLOCK_SIZE));
+}
+
+/*
+ * Allocate a block big enough to hold size bytes from the matching size class.
+ * Requests above SLAB_MAX_SIZE get memory of their own, rounded up to whole 64KiB
+ * slabs and taken from the page source under its lock.
+ * Arguments:
+ *     size_t size - Number of bytes requested.
+ * Returns:
+ *      void * - A block of memory for the thread to use or NULL if memory is exhausted.
+ */
+void *slab_alloc_size(size_t size) {
+    if(__builtin_expect(size > SLAB_MAX_SIZE, 0)) return span_alloc(thread_node(), size, 1, NULL);
+
+    return cache_alloc(size_to_class(size));
+}
+
+/*
+ * Allocate zeroed memory for an array. Large allocations that come fresh from the OS
+ * are zero already and aren't touched, so sparse buffers don't get faulted in whole.
+ * Arguments:
+ *     size_t count - Number of elements.
+ *     size_t size - Size of each element.
+ * Returns:
+ *      void * - The zeroed memory or NULL on overflow or if memory is exhausted.
+ */
+void *slab_calloc(size_t count, size_t size) {
+    size_t total;
+    if(__builtin_mul_overflow(count, size, &total)) return NULL;
+
+    // Blocks are always recycled memory, spans may be fresh
+    int zeroed = 0;
+    void *ptr;
+    if(total > SLAB_MAX_SIZE)
+        ptr = span_alloc(thread_node(), total, 1, &zeroed);
+    else
+        ptr = cache_alloc(size_to_class(total));
+
+    if(ptr && !zeroed)
+        memset(ptr, 0, total);
+
+    return ptr;
+}
+
+/*
+ * Allocate size bytes aligned to alignment. Blocks of power of two classes are
+ * aligned to their size, so small requests round up to such a class.
+ * Arguments:
+ *     size_t size - Number of bytes requested.
+ *     size_t alignment - Required alignment, a power of two.
+ * Returns:
+ *      void * - The memory or NULL if memory is exhausted.
+ */
+void *slab_alloc_aligned(size_t size, size_t alignment) {
+    if(alignment <= 16) return slab_alloc_size(size);
+
+    size_t rounded = size > alignment ? size : alignment;
+    if(rounded <= SLAB_MAX_SIZE)
+        return cache_alloc(size_to_class((size_t)1 << (64 - __builtin_clzll(rounded - 1))));
+
+    return span_alloc(thread_node(), size, alignment, NULL);
+}
+
+/*
+ * Free a block through the calling thread's cache. Blocks owned by another thread go
+ * onto that slab's remote free list.
+ * Arguments:
+ *     ThreadCache *thread - The calling thread's cache.
+ *     Slab *parent - The slab that owns the block.
+ *     Block *b - The block being freed.
+ */
+static void thread_free(ThreadCache *thread, Slab *parent, Block *b) {
+    // Cross-thread free: hand the block back to the owning thread
+    if(parent->owner != thread) {
+        Block *link = block_link(parent, b);
+        remote_free(parent, link, link);
+        STAT_ADD(thread->stats.remote_frees, 1);
+        return;
+    }
+
+    ClassCache *cache = &thread->classes[parent->size_class];
+
+    // Memory from another node goes straight home instead of into node-local magazines
+    if(__builtin_expect(parent->node != thread->node, 0)) {
+        Block *link = block_link(parent, b);
+        link->next = NULL;
+        slab_push_blocks(thread, parent, link);
+        return;
+    }
+
+    // Fast path: just push to the loaded magazine
+    if(__builtin_expect(cache->fastbin_count < thread->magazine_size, 1)) {
+        cache->fastbin[cache->fastbin_count++] = b;
+        return;
+    }
+
+    // The loaded magazine is full. Retire the previous one if it is full too: the depot
+    // gets it if it has room, otherwise its blocks go back to their slabs. Depots only
+    // hold the size classes, heaps always spill.
+    if(cache->previous_count) {
+        if(!thread->heap && depot_put(thread->node, parent->size_class, cache->previous))
+            STAT_ADD(thread->stats.depot_puts, 1);
+        else
+            spill_magazine(thread, cache->previous, cache->previous_count);
+    }
+
+    // The full loaded magazine becomes the previous one and we start a fresh one
+    memcpy(cache->previous, cache->fastbin, sizeof(cache->fastbin));
+    cache->previous_count = cache->fastbin_count;
+    cache->fastbin[0] = b;
+    cache->fastbin_count = 1;
+}
+
+/*
+ * Free a block back to the allocator. The page map gives the slab that owns the
+ * block, and with it the block's size class.
+ * Arguments:
+ *     void *block - The block that was allocated.
+ */
+void slab_free(void *block) {
+    // Get the parent of the block
+    Slab *parent = slab_of(block);
+    if(__builtin_expect(parent->size_class == SPAN_CLASS, 0)) {
+        span_free(parent);
+        return;
+    }
+
+    ThreadCache *thread = fast_thread_cache();
+
+    // Without a cache of our own the block can still go home the remote way
+    if(__builtin_expect(thread == NULL, 0)) {
+        Block *link = block_link(parent, block);
+        remote_free(parent, link, link);
+        return;
+    }
+
+    STAT_ADD(thread->stats.frees[parent->size_class], 1);
+
+#if HAVE_RSEQ
+    if(atomic_load_explicit(&percpu_active, memory_order_acquire)) {
+        if(__builtin_expect(percpu_push(parent->size_class, block), 1)) return;
+        percpu_free_slow(thread, parent, (Block *)block);
+        return;
+    }
+#endif
+
+    thread_free(thread, parent, (Block *)block);
+}
+
+/*
+ * Create a cache that isn't tied to any thread, for callers like fiber schedulers that
+ * manage caches themselves. It must only be used by one thread at a time.
+ * Returns:
+ *     ThreadCache * - The cache or NULL if memory is exhausted.
+ */
+ThreadCache *slab_thread_cache_create() {
+    pthread_once(&init_once, slab_global_init);
+    return new_thread_cache();
+}
+
+/*
+ * Retire a cache made by slab_thread_cache_create() or detached from a thread. Its
+ * cached blocks go back to their slabs and it is parked for the next thread to adopt,
+ * like the cache of an exited thread.
+ * Arguments:
+ *     ThreadCache *cache - The cache, not attached to any thread.
+ */
+void slab_thread_cache_destroy(ThreadCache *cache) {
+    retire_thread_cache(cache);
+
+    pthread_mutex_lock(&cache_lock);
+    cache->next_orphan = orphans;
+    orphans = cache;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Make a cache the calling thread's cache, so slab_alloc(), slab_free() and the rest
+ * go through it. The thread's previous cache is handed back to the caller; it is no
+ * longer retired when the thread exits, the attached one is instead.
+ * Arguments:
+ *     ThreadCache *cache - The cache to attach, not in use by any other thread. NULL
+ *                          leaves the thread without one until it next allocates.
+ * Returns:
+ *     ThreadCache * - The thread's previous cache, NULL if it had none.
+ */
+ThreadCache *slab_thread_cache_attach(ThreadCache *cache) {
+    pthread_once(&init_once, slab_global_init);
+
+    ThreadCache *previous = (ThreadCache *)pthread_getspecific(thread_cache_key);
+    if(cache)
+        move_to_node(cache, current_node());
+
+    pthread_setspecific(thread_cache_key, cache);
+    thread_cache = cache;
+    return previous;
+}
+
+/*
+ * Take the calling thread's cache away from it, for the caller to attach elsewhere
+ * or destroy.
+ * Returns:
+ *     ThreadCache * - The thread's cache, NULL if it had none.
+ */
+ThreadCache *slab_thread_cache_detach() {
+    return slab_thread_cache_attach(NULL);
+}
+
+/*
+ * Allocate from an explicit cache instead of the calling thread's. Nothing here goes
+ * through thread local storage or the CPU caches, large allocations included, so a
+ * cache can follow a fiber from one thread to another.
+ * Arguments:
+ *     ThreadCache *cache - A cache the calling thread is the only user of right now.
+ *     size_t size - Number of bytes requested.
+ * Returns:
+ *      void * - A block of memory or NULL if memory is exhausted.
+ */
+void *slab_alloc_from(ThreadCache *cache, size_t size) {
+    if(__builtin_expect(size > SLAB_MAX_SIZE, 0)) return span_alloc(cache->node, size, 1, NULL);
+
+    size_t size_class = size_to_class(size);
+    void *block = class_alloc(cache, size_class);
+    if(__builtin_expect(block != NULL, 1))
+        STAT_ADD(cache->stats.allocs[size_class], 1);
+    return block;
+}
+
+/*
+ * Free a block through an explicit cache. The block may come from any cache, blocks
+ * whose slab belongs to another one are handed back to it like cross-thread frees.
+ * Arguments:
+ *     ThreadCache *cache - A cache the calling thread is the only user of right now.
+ *     void *block - The block that was allocated.
+ */
+void slab_free_to(ThreadCache *cache, void *block) {
+    Slab *parent = slab_of(block);
+    if(__builtin_expect(parent->size_class == SPAN_CLASS, 0)) {
+        span_free(parent);
+        return;
+    }
+
+    STAT_ADD(cache->stats.frees[parent->size_class], 1);
+    thread_free(cache, parent, (Block *)block);
+}
+
+/*
+ * Check whether a pointer lies in memory the slab allocator handed out. This lets code
+ * that mixes allocators, like a malloc replacement, route frees to the right place.
+ * Arguments:
+ *     void *ptr - Any pointer.
+ * Returns:
+ *     int - 1 if ptr lies in a slab or large allocation, 0 otherwise.
+ */
+int slab_owns(void *ptr) {
+    return page_map_get(ptr) != NULL;
+}
+
+/*
+ * Get the number of bytes usable in a block, which is the size of its class.
+ * Arguments:
+ *     void *block - A block handed out by the slab allocator.
+ * Returns:
+ *     size_t - Usable size of the block.
+ */
+size_t slab_usable_size(void *block) {
+    return slab_of(block)->block_size;
+}
+
+/*
+ * Allocate a burst of BLOCK_SIZE blocks. The loaded magazine is handed out in whole
+ * runs and the thread cache is looked up once for the batch.
+ * Arguments:
+ *     void **out - Receives the blocks.
+ *     size_t n - Number of blocks wanted.
+ * Returns:
+ *     size_t - Number of blocks stored in out, less than n only if memory ran out.
+ */
+size_t slab_alloc_bulk(void **out, size_t n) {
+    size_t size_class = size_to_class(BLOCK_SIZE);
+    size_t done = 0;
+
+#if HAVE_RSEQ
+    if(atomic_load_explicit(&percpu_active, memory_order_acquire)) {
+        for(; done < n; done++) {
+            if(!(out[done] = cache_alloc(size_class))) break;
+        }
+        return done;
+    }
+#endif
+
+    ThreadCache *thread = fast_thread_cache();
+    if(!thread) return 0;
+    ClassCache *cache = &thread->classes[size_class];
+
+    while(done < n) {
+        // Take as much of the loaded magazine as the caller still needs
+        size_t take = n - done;
+        if(take > cache->fastbin_count)
+            take = cache->fastbin_count;
+
+        for(size_t i = 0; i < take; i++)
+            out[done++] = cache->fastbin[--cache->fastbin_count];
+        STAT_ADD(thread->stats.fastbin_hits, take);
+
+        if(done == n) break;
+
+        // The magazine ran dry, let the slow path load the next one
+        if(!(out[done] = class_alloc_slow(thread, size_class))) break;
+        done++;
+    }
+
+    STAT_ADD(thread->stats.allocs[size_class], done);
+    return done;
+}
+
+/*
+ * Free a burst of blocks. Consecutive blocks from the same slab are grouped, so blocks
+ * owned by another thread go back with one CAS per run instead of one per block.
+ * Arguments:
+ *     void **ptrs - The blocks being freed.
+ *     size_t n - Number of blocks in ptrs.
+ */
+void slab_free_bulk(void **ptrs, size_t n) {
+    ThreadCache *thread = fast_thread_cache();
+    if(!thread) {
+        for(size_t i = 0; i < n; i++)
+            slab_free(ptrs[i]);
+        return;
+    }
+
+    size_t i = 0;
+    while(i < n) {
+        Slab *parent = slab_of(ptrs[i]);
+        if(parent->size_class == SPAN_CLASS) {
+            span_free(parent);
+            i++;
+            continue;
+        }
+
+        // Find the run of blocks sharing this slab
+        size_t end = i + 1;
+        while(end < n && slab_of(ptrs[end]) == parent)
+            end++;
+
+        size_t count = end - i;
+        STAT_ADD(thread->stats.frees[parent->size_class], count);
+
+#if HAVE_RSEQ
+        if(atomic_load_explicit(&percpu_active, memory_order_acquire)) {
+            for(; i < end; i++) {
+                if(!percpu_push(parent->size_class, ptrs[i]))
+                    percpu_free_slow(thread, parent, (Block *)ptrs[i]);
+            }
+            continue;
+        }
+#endif
+
+        if(parent->owner != thread) {
+            // Chain the run together and hand it over in one push
+            for(size_t j = i; j < end - 1; j++)
+                ((Block *)ptrs[j])->next = (Block *)ptrs[j + 1];
+            remote_free(parent, (Block *)ptrs[i], (Block *)ptrs[end - 1]);
+            STAT_ADD(thread->stats.remote_frees, count);
+            i = end;
+            continue;
+        }
+
+        for(; i < end; i++)
+            thread_free(thread, parent, (Block *)ptrs[i]);
+    }
+}
+
+/*
+ * Choose the kind of pages new slab regions are backed by. Huge pages cut TLB misses
+ * on large heaps at the cost of coarser decommit. Regions that are already reserved
+ * keep their pages, so this is best called before the first allocation.
+ * Arguments:
+ *     SlabPageMode mode - The page kind to use from now on.
+ */
+void slab_set_page_mode(SlabPageMode mode) {
+    atomic_store_explicit(&page_mode, mode, memory_order_relaxed);
+}
+
+/*
+ * Choose whether allocations from the thread magazines prefetch the block that will be
+ * handed out next. This pays off when callers immediately write to what they get,
+ * e.g. when building linked structures. The per-CPU caches don't prefetch.
+ * Arguments:
+ *     SlabPrefetchMode mode - The prefetch mode to use from now on.
+ */
+void slab_set_prefetch(SlabPrefetchMode mode) {
+    atomic_store_explicit(&prefetch_mode, mode, memory_order_relaxed);
+}
+
+/*
+ * Switch the fast path between per-thread and per-CPU caches. Per-CPU caches keep the
+ * amount of cached memory proportional to the number of cores instead of the number
+ * of threads, which pays off when there are many more threads than cores. While they
+ * are on, threads keep no magazines of their own: the caller empties its magazines
+ * right away and every other thread on its next CPU cache refill or flush. They need
+ * restartable sequences; without them the per-thread caches stay in use. Turning them
+ * off empties every CPU's cache back into the slabs; a free racing with the switch
+ * may still land in a CPU cache, and is picked up again if they are turned back on.
+ * Arguments:
+ *     int enable - Nonzero to use per-CPU caches, zero for per-thread caches.
+ * Returns:
+ *     int - 1 if per-CPU caches are now in use, 0 otherwise.
+ */
+int slab_set_percpu(int enable) {
+#if HAVE_RSEQ
+    if(!enable || __rseq_size < 20) {
+        pthread_mutex_lock(&percpu_lock);
+        if(atomic_exchange_explicit(&percpu_active, 0, memory_order_relaxed)) {
+            ThreadCache *thread = fast_thread_cache();
+            if(thread)
+                percpu_flush(thread);
+        }
+        pthread_mutex_unlock(&percpu_lock);
+        return 0;
+    }
+
+    // Lay out one cache per possible CPU on first use
+    pthread_mutex_lock(&percpu_lock);
+    if(!percpu_caches) {
+        int cpus = count_possible("/sys/devices/system/cpu/possible", 1 << 16);
+        void *caches = mmap(NULL, (size_t)cpus << PERCPU_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(caches != MAP_FAILED) {
+            percpu_caches = caches;
+            percpu_cpus = cpus;
+        }
+    }
+    pthread_mutex_unlock(&percpu_lock);
+
+    if(!percpu_caches) return 0;
+    atomic_fetch_add_explicit(&percpu_generation, 1, memory_order_relaxed);
+    atomic_store_explicit(&percpu_active, 1, memory_order_release);
+
+    ThreadCache *thread = fast_thread_cache();
+    if(thread)
+        percpu_catch_up(thread);
+    return 1;
+#else
+    (void)enable;
+    return 0;
+#endif
+}
+
+/*
+ * Take every allocator lock before fork(), so the child doesn't inherit one that
+ * another thread of the parent was holding. That includes the locks of every heap,
+ * which stay put while the heap registry is locked. Locks are taken in the order the
+ * allocator nests them: page sources before the page map.
+ */
+static void slab_prefork() {
+#if HAVE_RSEQ
+    pthread_mutex_lock(&percpu_lock);
+#endif
+    pthread_mutex_lock(&cache_lock);
+    pthread_mutex_lock(&heap_lock);
+    for(SlabHeap *heap = all_heaps; heap; heap = heap->next_heap)
+        pthread_mutex_lock(&heap->lock);
+    for(int node = 0; node < MAX_NUMA_NODES; node++) {
+        for(int i = 0; i < SLAB_SIZE_CLASSES; i++)
+            pthread_mutex_lock(&depots[node][i].lock);
+    }
+    for(int node = 0; node < MAX_NUMA_NODES; node++)
+        pthread_mutex_lock(&page_sources[node].lock);
+    for(SlabHeap *heap = all_heaps; heap; heap = heap->next_heap) {
+        if(heap->pages)
+            pthread_mutex_lock(&heap->pages->lock);
+    }
+    pthread_mutex_lock(&page_map_lock);
+}
+
+/*
+ * Release the locks taken by slab_prefork(), in the parent and in the child.
+ */
+static void slab_postfork() {
+    pthread_mutex_unlock(&page_map_lock);
+    for(SlabHeap *heap = all_heaps; heap; heap = heap->next_heap) {
+        if(heap->pages)
+            pthread_mutex_unlock(&heap->pages->lock);
+    }
+    for(int node = MAX_NUMA_NODES - 1; node >= 0; node--)
+        pthread_mutex_unlock(&page_sources[node].lock);
+    for(int node = MAX_NUMA_NODES - 1; node >= 0; node--) {
+        for(int i = SLAB_SIZE_CLASSES - 1; i >= 0; i--)
+            pthread_mutex_unlock(&depots[node][i].lock);
+    }
+    for(SlabHeap *heap = all_heaps; heap; heap = heap->next_heap)
+        pthread_mutex_unlock(&heap->lock);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&cache_lock);
+#if HAVE_RSEQ
+    pthread_mutex_unlock(&percpu_lock);
+#endif
+}
+
+/*
+ * Give as much free memory back to the OS as possible: magazines parked in the depot
+ * go back to their slabs, the calling thread releases the fully free slabs it was
+ * holding on to, cached large mappings are unmapped and every free run in the page
+ * source is decommitted.
+ * Other threads keep their own retained slabs until they release them.
+ * Returns:
+ *     size_t - Number of bytes handed back to the OS.
+ */
+size_t slab_trim() {
+    ThreadCache *thread = fast_thread_cache();
+    if(!thread) return 0;
+
+    // Send depot magazines home so their slabs can become free
+    for(int node = 0; node < numa_nodes; node++) {
+        for(int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+            void *rounds[SLAB_MAGAZINE_SIZE];
+            while(depot_get(node, i, rounds))
+                spill_magazine(thread, rounds, SLAB_MAGAZINE_SIZE);
+        }
+    }
+
+    // Pick up blocks other threads freed into our slabs and drop our empty slabs
+    drain_remote_frees(thread);
+    for(int i = 0; i < SLAB_SIZE_CLASSES; i++)
+        release_empty_slabs(&thread->classes[i]);
+
+    size_t released = 0;
+    for(int node = 0; node < numa_nodes; node++) {
+        released += page_flush_mappings(&page_sources[node]);
+        released += page_decommit(&page_sources[node], 0) * SLAB_SIZE;
+    }
+
+    return released;
+}
+
+/*
+ * Add the memory a page source holds to the statistics.
+ * Arguments:
+ *     PageSource *source - The page source.
+ *     SlabStats *stats - Statistics to add to.
+ */
+static void page_stats(PageSource *source, SlabStats *stats) {
+    pthread_mutex_lock(&source->lock);
+    stats->slab_bytes += source->slabs_out * SLAB_SIZE;
+    stats->free_bytes += source->free_count * SLAB_SIZE;
+    stats->decommitted_bytes += (source->free_slabs - source->free_count) * SLAB_SIZE;
+    stats->mapped_bytes += source->mapped_bytes;
+    stats->large_bytes += source->large_bytes;
+    stats->span_cache_bytes += source->mapping_bytes;
+    pthread_mutex_unlock(&source->lock);
+}
+
+/*
+ * Collect allocator statistics. Counters of every thread cache, live or parked after
+ * its thread exited, are summed up together with the state of the depots and page
+ * sources. Counters are read while other threads keep updating them, so the result
+ * is a close snapshot rather than an exact one.
+ * Arguments:
+ *     SlabStats *stats - Receives the statistics.
+ */
+void slab_stats(SlabStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_once(&init_once, slab_global_init);
+
+    // Add up the per-thread counters
+    size_t allocs[SLAB_SIZE_CLASSES] = { 0 };
+    size_t frees[SLAB_SIZE_CLASSES] = { 0 };
+
+    pthread_mutex_lock(&cache_lock);
+    for(ThreadCache *cache = all_caches; cache; cache = cache->next_cache) {
+        ThreadStats *ts = &cache->stats;
+        stats->threads++;
+
+        for(int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+            allocs[i] += atomic_load_explicit(&ts->allocs[i], memory_order_relaxed);
+            frees[i] += atomic_load_explicit(&ts->frees[i], memory_order_relaxed);
+        }
+
+        stats->fastbin_hits += atomic_load_explicit(&ts->fastbin_hits, memory_order_relaxed);
+        stats->percpu_hits += atomic_load_explicit(&ts->percpu_hits, memory_order_relaxed);
+        stats->percpu_misses += atomic_load_explicit(&ts->percpu_misses, memory_order_relaxed);
+        stats->percpu_overflows += atomic_load_explicit(&ts->percpu_overflows, memory_order_relaxed);
+        stats->depot_gets += atomic_load_explicit(&ts->depot_gets, memory_order_relaxed);
+        stats->depot_puts += atomic_load_explicit(&ts->depot_puts, memory_order_relaxed);
+        stats->slab_refills += atomic_load_explicit(&ts->slab_refills, memory_order_relaxed);
+        stats->partial_pops += atomic_load_explicit(&ts->partial_pops, memory_order_relaxed);
+        stats->new_slabs += atomic_load_explicit(&ts->new_slabs, memory_order_relaxed);
+        stats->slabs_released += atomic_load_explicit(&ts->slabs_released, memory_order_relaxed);
+        stats->remote_frees += atomic_load_explicit(&ts->remote_frees, memory_order_relaxed);
+        stats->remote_drained += atomic_load_explicit(&ts->remote_drained, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // A block freed by another thread than the one that allocated it shows up in
+    // different caches, only the totals are meaningful. Those caches are read at
+    // different moments, so a free can be counted before its alloc: clamp at zero
+    // rather than wrap around.
+    for(int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+        stats->allocs += allocs[i];
+        stats->frees += frees[i];
+
+        ptrdiff_t in_use = (ptrdiff_t)(allocs[i] - frees[i]);
+        stats->class_bytes_in_use[i] = in_use > 0 ? (size_t)in_use * size_classes[i] : 0;
+        stats->bytes_in_use += stats->class_bytes_in_use[i];
+    }
+
+    // Magazines parked in the depots
+    for(int node = 0; node < numa_nodes; node++) {
+        for(int i = 0; i < SLAB_SIZE_CLASSES; i++) {
+            size_t magazines = atomic_load_explicit(&depots[node][i].count, memory_order_relaxed);
+            stats->depot_bytes += magazines * SLAB_MAGAZINE_SIZE * size_classes[i];
+        }
+    }
+
+    // Memory held by the page sources
+    for(int node = 0; node < numa_nodes; node++)
+        page_stats(&page_sources[node], stats);
+
+    // Standalone heaps draw from page sources of their own
+    pthread_mutex_lock(&heap_lock);
+    for(SlabHeap *heap = all_heaps; heap; heap = heap->next_heap) {
+        if(heap->pages)
+            page_stats(heap->pages, stats);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * Tear down a thread's state for a heap when the thread exits. Like the size class
+ * caches it is retired and parked for the next thread, but on the heap's own orphan
+ * list.
+ * Arguments:
+ *     void *arg - Pointer to the thread cache.
+ */
+static void heap_thread_destructor(void *arg) {
+    ThreadCache *thread = (ThreadCache *)arg;
+    if(!thread) return;
+
+    SlabHeap *heap = thread->heap;
+    retire_thread_cache(thread);
+
+    pthread_mutex_lock(&heap->lock);
+    thread->next_orphan = heap->orphans;
+    heap->orphans = thread;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Get the calling thread's state for a heap, adopting an orphaned one or creating it
+ * on first use. A heap has a single class, so its caches are small enough to come
+ * from the size classes rather than pages of their own.
+ * Arguments:
+ *     SlabHeap *heap - The heap.
+ * Returns:
+ *     ThreadCache * - The thread's cache for the heap or NULL on error.
+ */
+static ThreadCache *heap_thread_cache(SlabHeap *heap) {
+    ThreadCache *thread = (ThreadCache *)pthread_getspecific(heap->key);
+    if(__builtin_expect(thread != NULL, 1)) return thread;
+
+    pthread_mutex_lock(&heap->lock);
+    thread = heap->orphans;
+    if(thread)
+        heap->orphans = thread->next_orphan;
+    pthread_mutex_unlock(&heap->lock);
+
+    if(!thread) {
+        thread = slab_calloc(1, sizeof(ThreadCache) + sizeof(ClassCache));
+        if(!thread) return NULL;
+        thread->class_count = 1;
+        thread->heap = heap;
+        thread->magazine_size = heap->magazine_size;
+
+        pthread_mutex_lock(&heap->lock);
+        thread->next_cache = heap->caches;
+        heap->caches = thread;
+        pthread_mutex_unlock(&heap->lock);
+    }
+
+    thread->next_orphan = NULL;
+    move_to_node(thread, current_node());
+    pthread_setspecific(heap->key, thread);
+    return thread;
+}
+
+/*
+ * Set up an empty heap with its own thread cache key. The caller fills in the geometry.
+ * Returns:
+ *     SlabHeap * - The heap or NULL on error.
+ */
+static SlabHeap *heap_new() {
+    pthread_once(&init_once, slab_global_init);
+
+    SlabHeap *heap = mmap(NULL, sizeof(SlabHeap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(heap == MAP_FAILED) return NULL;
+
+    if(pthread_key_create(&heap->key, heap_thread_destructor) != 0) {
+        munmap(heap, sizeof(SlabHeap));
+        return NULL;
+    }
+    pthread_mutex_init(&heap->lock, NULL);
+
+    return heap;
+}
+
+/*
+ * Add a heap to the registry once it is fully set up, so fork() and the statistics
+ * never see it half made.
+ * Arguments:
+ *     SlabHeap *heap - The heap.
+ */
+static void heap_register(SlabHeap *heap) {
+    pthread_mutex_lock(&heap_lock);
+    heap->next_heap = all_heaps;
+    if(all_heaps)
+        all_heaps->prev_heap = heap;
+    all_heaps = heap;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * Unmap a heap's thread caches, its private page source's regions if it has one and
+ * the heap itself. Must only be called once no thread uses the heap any more.
+ * Arguments:
+ *     SlabHeap *heap - The heap.
+ */
+static void heap_delete(SlabHeap *heap) {
+    // Leave the registry first, nobody may look at the page source while it goes away
+    pthread_mutex_lock(&heap_lock);
+    if(heap->prev_heap)
+        heap->prev_heap->next_heap = heap->next_heap;
+    else
+        all_heaps = heap->next_heap;
+    if(heap->next_heap)
+        heap->next_heap->prev_heap = heap->prev_heap;
+    pthread_mutex_unlock(&heap_lock);
+
+    pthread_key_delete(heap->key);
+
+    ThreadCache *thread = heap->caches;
+    while(thread) {
+        ThreadCache *next = thread->next_cache;
+        slab_free(thread);
+        thread = next;
+    }
+
+    if(heap->pages) {
+        Slab *region = heap->pages->regions;
+        while(region) {
+            Slab *next = region->next;
+            page_map_set(region->mem, region->block_size, NULL);
+            munmap(region->mem, region->block_size);
+            region = next;
+        }
+        pthread_mutex_destroy(&heap->pages->lock);
+    }
+
+    pthread_mutex_destroy(&heap->lock);
+    munmap(heap, sizeof(SlabHeap));
+}
+
+/*
+ * Create a cache for objects of one type. Objects are packed into slabs of their own
+ * at the object's size, rounded up to the alignment. With a constructor, each object
+ * is constructed when its slab is first populated and keeps its constructed state
+ * across slab_cache_free() and slab_cache_alloc(), so callers must hand objects back
+ * in that state. The destructor runs when a slab is released.
+ * Arguments:
+ *     const char *name - Name of the cache, for debugging.
+ *     size_t size - Size of each object.
+ *     size_t align - Alignment of each object, a power of two or 0 for the default of 16.
+ *     void (*ctor)(void *) - Constructor, may be NULL.
+ *     void (*dtor)(void *) - Destructor, may be NULL.
+ * Returns:
+ *     SlabCache * - The cache or NULL if the geometry is unsupported or memory ran out.
+ */
+SlabCache *slab_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *), void (*dtor)(void *)) {
+    if(align & (align - 1) || size > OBJECT_MAX_SIZE || align > OBJECT_MAX_SIZE) return NULL;
+    if(align < 16)
+        align = 16;
+
+    // Objects with constructed state get their free link appended, the rest share it
+    size_t link_offset = 0;
+    size_t block_size = size ? size : 1;
+    if(ctor || dtor) {
+        link_offset = ALIGN_UP(size, sizeof(Block));
+        block_size = link_offset + sizeof(Block);
+    }
+    block_size = ALIGN_UP(block_size, align);
+    if(block_size > OBJECT_MAX_SIZE) return NULL;
+
+    SlabCache *cache = heap_new();
+    if(!cache) return NULL;
+
+    if(name)
+        strncpy(cache->name, name, OBJECT_NAME_MAX - 1);
+    cache->block_size = block_size;
+    cache->link_offset = link_offset;
+    cache->slab_slabs = 1;
+    cache->magazine_size = SLAB_MAGAZINE_SIZE;
+    cache->empty_slabs = OBJECT_EMPTY_SLABS;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    heap_register(cache);
+
+    return cache;
+}
+
+/*
+ * Allocate an object from an object cache.
+ * Arguments:
+ *     SlabCache *cache - The object cache.
+ * Returns:
+ *     void * - A constructed object or NULL if memory is exhausted.
+ */
+void *slab_cache_alloc(SlabCache *cache) {
+    return slab_heap_alloc(cache);
+}
+
+/*
+ * Give an object back to its cache. It stays constructed and may be handed out
+ * again as it is.
+ * Arguments:
+ *     SlabCache *cache - The cache the object was allocated from.
+ *     void *object - The object.
+ */
+void slab_cache_free(SlabCache *cache, void *object) {
+    slab_heap_free(cache, object);
+}
+
+/*
+ * Destroy an object cache. Every object must have been freed and no thread may use
+ * the cache any more. All objects are destructed and their slabs go back to the
+ * page source.
+ * Arguments:
+ *     SlabCache *cache - The object cache.
+ */
+void slab_cache_destroy(SlabCache *cache) {
+    // Retiring a cache can send blocks to slabs of another, so drain everything again
+    // once all magazines are empty
+    for(ThreadCache *thread = cache->caches; thread; thread = thread->next_cache)
+        retire_thread_cache(thread);
+    for(ThreadCache *thread = cache->caches; thread; thread = thread->next_cache) {
+        drain_remote_frees(thread);
+        release_empty_slabs(&thread->classes[0]);
+    }
+
+    heap_delete(cache);
+}
+
+/*
+ * Create a standalone heap. It serves blocks of a single size from slabs of its own
+ * geometry, has its own thread caches tuned by the configuration and its own page
+ * source, so its memory never mixes with other heaps or the size classes.
+ * Arguments:
+ *     const SlabHeapConfig *config - Geometry and cache limits of the heap.
+ * Returns:
+ *     SlabHeap * - The heap or NULL if the geometry is unsupported or memory ran out.
+ */
+SlabHeap *slab_heap_create(const SlabHeapConfig *config) {
+    size_t block_size = ALIGN_UP(config->block_size ? config->block_size : 1, 16);
+    size_t slab_size = config->slab_size ? config->slab_size : SLAB_SIZE;
+    size_t magazine_size = config->magazine_size ? config->magazine_size : SLAB_MAGAZINE_SIZE;
+
+    // Blocks must fit the free map. Heap blocks keep their free link at the start, so
+    // the reciprocal only ever sees offsets of whole blocks, which come out exact for
+    // any slab up to HEAP_SLAB_MAX whatever the block size.
+    if(slab_size % SLAB_SIZE || slab_size > HEAP_SLAB_MAX || block_size > slab_size) return NULL;
+    if(slab_size / block_size > SLAB_MAP_WORDS * 64) return NULL;
+    if(magazine_size > SLAB_MAGAZINE_SIZE) return NULL;
+
+    SlabHeap *heap = heap_new();
+    if(!heap) return NULL;
+
+    heap->block_size = block_size;
+    heap->slab_slabs = slab_size / SLAB_SIZE;
+    heap->magazine_size = magazine_size;
+    heap->empty_slabs = config->empty_slabs ? config->empty_slabs : THREAD_EMPTY_SLABS;
+
+    heap->pages = &heap->private_pages;
+    pthread_mutex_init(&heap->pages->lock, NULL);
+    heap->pages->node = current_node();
+    heap_register(heap);
+
+    return heap;
+}
+
+/*
+ * Allocate a block from a heap.
+ * Arguments:
+ *     SlabHeap *heap - The heap.
+ * Returns:
+ *     void * - A block of the heap's size or NULL if memory is exhausted.
+ */
+void *slab_heap_alloc(SlabHeap *heap) {
+    ThreadCache *thread = heap_thread_cache(heap);
+    if(!thread) return NULL;
+
+    void *block = class_alloc(thread, 0);
+    if(__builtin_expect(block != NULL, 1))
+        STAT_ADD(thread->stats.allocs[0], 1);
+    return block;
+}
+
+/*
+ * Give a block back to its heap.
+ * Arguments:
+ *     SlabHeap *heap - The heap the block was allocated from.
+ *     void *block - The block.
+ */
+void slab_heap_free(SlabHeap *heap, void *block) {
+    Slab *parent = slab_of(block);
+    ThreadCache *thread = (ThreadCache *)pthread_getspecific(heap->key);
+
+    // A thread that never allocated from the heap doesn't get a cache just to free,
+    // the block goes home the remote way
+    if(!thread) {
+        Block *link = block_link(parent, block);
+        remote_free(parent, link, link);
+        return;
+    }
+
+    STAT_ADD(thread->stats.frees[0], 1);
+    thread_free(thread, parent, (Block *)block);
+}
+
+/*
+ * Destroy a standalone heap along with every block still allocated from it. Its
+ * regions are unmapped wholesale, nothing is walked block by block. No thread may use
+ * the heap or any of its blocks any more.
+ * Arguments:
+ *     SlabHeap *heap - The heap.
+ */
+void slab_heap_destroy(SlabHeap *heap) {
+    heap_delete(heap);
+}
+
+/*
+ * Set up an arena in a fresh chunk, whose start holds a header of the given size.
+ * Arguments:
+ *     SlabArena *arena - The arena, inside the header.
+ *     char *chunk - The first chunk, from span_alloc().
+ *     size_t header - Bytes at the start of the chunk that aren't handed out.
+ */
+static void arena_init(SlabArena *arena, char *chunk, size_t header) {
+    arena->first = slab_of(chunk);
+    arena->spans = NULL;
+    arena->base = chunk + ALIGN_UP(header, 16);
+    arena->bump = arena->base;
+    arena->end = chunk + ARENA_CHUNK_SIZE;
+}
+
+/*
+ * Give the arena's newest spans back to the page source, up to a given one.
+ * Arguments:
+ *     SlabArena *arena - The arena.
+ *     Slab *until - First span to keep, NULL to free them all.
+ */
+static void arena_free_spans(SlabArena *arena, Slab *until) {
+    Slab *span = arena->spans;
+    while(span != until) {
+        Slab *next = span->next;
+        span_free(span);
+        span = next;
+    }
+    arena->spans = until;
+}
+
+/*
+ * Create an arena for memory that is freed all at once.
+ * Returns:
+ *     SlabArena * - The arena or NULL if memory is exhausted.
+ */
+SlabArena *slab_arena_create() {
+    char *chunk = span_alloc(thread_node(), ARENA_CHUNK_SIZE, 1, NULL);
+    if(!chunk) return NULL;
+
+    SlabArena *arena = (SlabArena *)chunk;
+    arena_init(arena, chunk, sizeof(SlabArena));
+    return arena;
+}
+
+/*
+ * Get memory from an arena once the current chunk can't hold the request. Large
+ * requests get a span of their own so the current chunk isn't abandoned for them.
+ * Arguments:
+ *     SlabArena *arena - The arena.
+ *     size_t size - Number of bytes requested, a multiple of 16.
+ * Returns:
+ *     void * - The memory or NULL if memory is exhausted.
+ */
+static void *arena_alloc_slow(SlabArena *arena, size_t size) {
+    char *mem = span_alloc(thread_node(), size > ARENA_LARGE_SIZE ? size : ARENA_CHUNK_SIZE, 1, NULL);
+    if(!mem) return NULL;
+
+    Slab *span = slab_of(mem);
+    span->next = arena->spans;
+    arena->spans = span;
+
+    if(size <= ARENA_LARGE_SIZE) {
+        arena->bump = mem + size;
+        arena->end = mem + ARENA_CHUNK_SIZE;
+    }
+    return mem;
+}
+
+/*
+ * Allocate memory from an arena. It can't be freed on its own, only by resetting or
+ * destroying the arena.
+ * Arguments:
+ *     SlabArena *arena - The arena.
+ *     size_t size - Number of bytes requested.
+ * Returns:
+ *     void * - 16 byte aligned memory or NULL if memory is exhausted.
+ */
+void *slab_arena_alloc(SlabArena *arena, size_t size) {
+    if(size > SIZE_MAX - SLAB_SIZE) return NULL;
+    size = ALIGN_UP(size ? size : 1, 16);
+
+    if(__builtin_expect(size <= (size_t)(arena->end - arena->bump), 1)) {
+        void *mem = arena->bump;
+        arena->bump += size;
+        return mem;
+    }
+
+    return arena_alloc_slow(arena, size);
+}
+
+/*
+ * Free everything allocated from an arena. Every chunk but the one holding the arena
+ * goes back to the page source as a whole, one span at a time, and the arena starts
+ * over in its first chunk.
+ * Arguments:
+ *     SlabArena *arena - The arena.
+ */
+void slab_arena_reset(SlabArena *arena) {
+    arena_free_spans(arena, NULL);
+    arena->bump = arena->base;
+    arena->end = (char *)arena->first->mem + ARENA_CHUNK_SIZE;
+}
+
+/*
+ * Free everything allocated from an arena along with the arena itself.
+ * Arguments:
+ *     SlabArena *arena - The arena.
+ */
+void slab_arena_destroy(SlabArena *arena) {
+    slab_arena_reset(arena);
+    span_free(arena->first);
+}
+
+/*
+ * Create a memory context. Its memory lives until the context is reset or deleted,
+ * or until the same happens to one of its ancestors. Like arenas, a context must
+ * only be used by one thread at a time.
+ * Arguments:
+ *     SlabContext *parent - Context to create it under, NULL for a root context.
+ * Returns:
+ *     SlabContext * - The context or NULL if memory is exhausted.
+ */
+SlabContext *slab_context_create(SlabContext *parent) {
+    char *chunk = span_alloc(thread_node(), ARENA_CHUNK_SIZE, 1, NULL);
+    if(!chunk) return NULL;
+
+    SlabContext *context = (SlabContext *)chunk;
+    arena_init(&context->arena, chunk, sizeof(SlabContext));
+    context->parent = parent;
+    context->children = NULL;
+    context->prev_sibling = NULL;
+    context->next_sibling = NULL;
+
+    if(parent) {
+        context->next_sibling = parent->children;
+        if(parent->children)
+            parent->children->prev_sibling = context;
+        parent->children = context;
+    }
+
+    return context;
+}
+
+/*
+ * Allocate memory from a context. It can't be freed on its own, only by resetting,
+ * deleting or releasing the context to an earlier mark.
+ * Arguments:
+ *     SlabContext *context - The context.
+ *     size_t size - Number of bytes requested.
+ * Returns:
+ *     void * - 16 byte aligned memory or NULL if memory is exhausted.
+ */
+void *slab_context_alloc(SlabContext *context, size_t size) {
+    return slab_arena_alloc(&context->arena, size);
+}
+
+/*
+ * Delete every child of a context, along with their own subtrees.
+ * Arguments:
+ *     SlabContext *context - The context.
+ */
+static void context_delete_children(SlabContext *context) {
+    while(context->children) {
+        SlabContext *child = context->children;
+        context->children = child->next_sibling;
+
+        context_delete_children(child);
+        slab_arena_destroy(&child->arena);
+    }
+}
+
+/*
+ * Free everything allocated from a context and delete all of its children. The
+ * context itself stays usable and any marks taken on it become invalid.
+ * Arguments:
+ *     SlabContext *context - The context.
+ */
+void slab_context_reset(SlabContext *context) {
+    context_delete_children(context);
+    slab_arena_reset(&context->arena);
+}
+
+/*
+ * Delete a context and its subtree, freeing everything allocated from them.
+ * Arguments:
+ *     SlabContext *context - The context.
+ */
+void slab_context_delete(SlabContext *context) {
+    context_delete_children(context);
+
+    SlabContext *parent = context->parent;
+    if(parent) {
+        if(context->prev_sibling)
+            context->prev_sibling->next_sibling = context->next_sibling;
+        else
+            parent->children = context->next_sibling;
+        if(context->next_sibling)
+            context->next_sibling->prev_sibling = context->prev_sibling;
+    }
+
+    // The context lives in its first chunk, so this goes last
+    slab_arena_destroy(&context->arena);
+}
+
+/*
+ * Remember how far a context has allocated, so everything allocated after this
+ * point can be dropped with slab_context_release_to_mark().
+ * Arguments:
+ *     SlabContext *context - The context.
+ *     SlabMark *mark - Receives the mark.
+ */
+void slab_context_mark(SlabContext *context, SlabMark *mark) {
+    mark->spans = context->arena.spans;
+    mark->bump = context->arena.bump;
+    mark->end = context->arena.end;
+}
+
+/*
+ * Free everything allocated from a context since a mark was taken. Spans are kept
+ * newest first, so the ones to drop are exactly those ahead of the mark's, and the
+ * chunk the mark pointed into is still around to rewind into. Marks must be released
+ * in stack order; child contexts are not affected.
+ * Arguments:
+ *     SlabContext *context - The context.
+ *     const SlabMark *mark - A mark taken on the context since it was last reset.
+ */
+void slab_context_release_to_mark(SlabContext *context, const SlabMark *mark) {
+    arena_free_spans(&context->arena, mark->spans);
+    context->arena.bump = mark->bump;
+    context->arena.end = mark->end;
+}
@@ -2,27 +2,179 @@
 #define ALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SLAB_SIZE_CLASSES 28        // Number of size classes served by the allocator.
+#define SLAB_MAX_SIZE 4096          // Largest request that can be served from a slab. Larger ones take whole 64KiB slabs.
+#define SLAB_MAGAZINE_SIZE 32       // Blocks per magazine. Each thread holds at most two magazines per class.
+#define SLAB_MAP_WORDS 64           // Free map words per slab: 64KiB of 16 byte blocks, one bit each.
+
+typedef enum {
+    SLAB_PAGES_DEFAULT,         // Regular pages.
+    SLAB_PAGES_THP,             // Regular mappings with a transparent huge page hint (MADV_HUGEPAGE).
+    SLAB_PAGES_HUGETLB_2M,      // Explicit 2MiB pages (MAP_HUGETLB), falling back to THP.
+    SLAB_PAGES_HUGETLB_1G,      // Explicit 1GiB pages (MAP_HUGETLB), falling back to 2MiB pages.
+} SlabPageMode;
+
+typedef enum {
+    SLAB_PREFETCH_NONE,         // No software prefetch.
+    SLAB_PREFETCH_READ,         // Prefetch the next block a magazine will hand out.
+    SLAB_PREFETCH_WRITE,        // Same, but fetch the line for writing since callers usually initialize new blocks.
+} SlabPrefetchMode;
 
 typedef struct block {
-    struct block *next;         // Free list used for cached allocations (intrusive linked list).
+    struct block *next;         // Links chains of freed blocks on their way back to a slab (intrusive linked list).
 } Block;
 
+struct threadcache;
+typedef struct slabheap SlabHeap;
+typedef struct slabheap SlabCache;  // An object cache is a heap whose blocks hold constructed objects.
+typedef struct slabarena SlabArena;
+typedef struct slabcontext SlabContext;
+
 typedef struct slab {
-    void *mem;                  // Aligned memory allocation.
-    void *raw_allocation;       // Non-aligned allocation of the memory.
+    void *mem;                  // Aligned block memory. The descriptor itself lives out of line.
+    struct threadcache *owner;  // Thread cache that carved the slab. Only the owner touches free_map.
+    int node;                   // NUMA node the slab's memory lives on.
+    size_t size_class;          // Index of the size class this slab was carved for.
+    size_t block_size;          // Size of every block in the slab.
+    size_t block_count;         // Total number of usable blocks in the slab.
     size_t free_count;          // Total number of free blocks available in slab.
-    Block *free_list;           // Linked list of blocks to allocate from.
+    uint32_t reciprocal;        // 2^32 / block_size rounded up, turns block offsets into indices.
+    uint32_t link_offset;       // Where a free block keeps its chain link. Past the object in constructed caches, 0 otherwise.
+    size_t map_hint;            // No free bits below this word of free_map.
     struct slab *next;          // If we use up one of the slabs, we need to allocate a new one, but keep tracking the old one.
+    struct slab *prev;          // Back link in the partial list so empty slabs can be unlinked in place.
+    _Atomic uintptr_t remote_free;  // Blocks freed by other threads. Bit 0 is set while the slab is queued on its owner.
+    struct slab *remote_next;   // Link in the owner's remote_slabs list.
+    size_t free_run;            // Length of the free run the slab starts or ends, 0 while in use. Guarded by the page source lock.
+    uint64_t free_map[SLAB_MAP_WORDS];  // One bit per block, set while the block is free in the slab.
 } Slab;
 
-typedef struct threadcache {
+typedef struct classcache {
     Slab *current_slab;         // Used by each thread to cache a slab for quick allocation.
     Slab *partial_slabs;        // Used by each thread to cache non-empty threads for quick allocation.
-    Block *fastbin;             // Used to quickly cache recently freed blocks.
-    size_t fastbin_count;       // Used to cap the number of fastbin blocks.
+    size_t fastbin_count;       // Number of blocks in the loaded magazine.
+    void *fastbin[SLAB_MAGAZINE_SIZE];  // Loaded magazine: recently freed blocks, popped from the top first.
+    size_t previous_count;      // Number of blocks in the previous magazine, always either full or empty.
+    void *previous[SLAB_MAGAZINE_SIZE]; // Previous magazine.
+    size_t empty_count;         // Fully free slabs retained on the partial list.
+} ClassCache;
+
+typedef struct threadstats {
+    _Atomic size_t allocs[SLAB_SIZE_CLASSES];   // Blocks handed out through this thread, per size class.
+    _Atomic size_t frees[SLAB_SIZE_CLASSES];    // Blocks freed through this thread, per size class.
+    _Atomic size_t fastbin_hits;                // Allocations served straight from the loaded magazine.
+    _Atomic size_t percpu_hits;                 // Allocations served straight from a CPU cache.
+    _Atomic size_t percpu_misses;               // CPU cache refills from this thread.
+    _Atomic size_t percpu_overflows;            // CPU cache flushes into this thread.
+    _Atomic size_t depot_gets;                  // Full magazines taken from the depot.
+    _Atomic size_t depot_puts;                  // Full magazines handed to the depot.
+    _Atomic size_t slab_refills;                // Magazines loaded from the thread's slabs.
+    _Atomic size_t partial_pops;                // Partial slabs made current.
+    _Atomic size_t new_slabs;                   // Slabs taken from the page source.
+    _Atomic size_t slabs_released;              // Fully free slabs given back to the page source.
+    _Atomic size_t remote_frees;                // Blocks pushed to a slab owned by another thread.
+    _Atomic size_t remote_drained;              // Blocks other threads returned to this thread's slabs.
+} ThreadStats;
+
+typedef struct threadcache {
+    _Atomic(Slab *) remote_slabs;           // Owned slabs that other threads have freed blocks into.
+    struct threadcache *next_orphan;        // Link in the orphan list once the owning thread has exited.
+    int node;                               // NUMA node the thread last ran on.
+    Slab *parked_slabs;                     // Partly used slabs of other nodes, waiting for their blocks to come home.
+    struct threadcache *next_cache;         // Link in the registry of all caches.
+    SlabHeap *heap;                         // Heap this is the thread's state for, NULL for the size classes.
+    size_t magazine_size;                   // Blocks a magazine holds, at most SLAB_MAGAZINE_SIZE.
+    size_t class_count;                     // Entries in classes: SLAB_SIZE_CLASSES, or 1 for a heap.
+    unsigned percpu_generation;             // Last time CPU caches were turned on that the magazines were emptied for.
+    ThreadStats stats;                      // Counters, written only by the owning thread.
+    ClassCache classes[];                   // One independent cache per size class, sized when the cache is created.
 } ThreadCache;
 
+typedef struct slabheapconfig {
+    size_t block_size;          // Size of every block of the heap.
+    size_t slab_size;           // Bytes per slab, a multiple of 64KiB up to 1MiB. 0 for 64KiB.
+    size_t magazine_size;       // Blocks per magazine, up to SLAB_MAGAZINE_SIZE. 0 for the maximum.
+    size_t empty_slabs;         // Fully free slabs each thread keeps before releasing them. 0 for 1.
+} SlabHeapConfig;
+
+typedef struct slabmark {
+    struct slab *spans;         // Newest span of the context when the mark was taken.
+    char *bump;                 // Bump pointer when the mark was taken.
+    char *end;                  // End of the chunk the bump pointer was in.
+} SlabMark;
+
+typedef struct slabstats {
+    size_t threads;                                 // Thread caches, live or parked after their thread exited.
+    size_t allocs;                                  // Blocks handed out.
+    size_t frees;                                   // Blocks freed.
+    size_t bytes_in_use;                            // Bytes handed out and not yet freed.
+    size_t class_bytes_in_use[SLAB_SIZE_CLASSES];   // bytes_in_use split by size class.
+    size_t fastbin_hits;                            // Allocations served from a thread's loaded magazine.
+    size_t percpu_hits;                             // Allocations served from a CPU cache.
+    size_t percpu_misses;                           // CPU cache refills.
+    size_t percpu_overflows;                        // CPU cache flushes.
+    size_t depot_gets;                              // Full magazines taken from the depot.
+    size_t depot_puts;                              // Full magazines handed to the depot.
+    size_t slab_refills;                            // Magazines loaded from slabs.
+    size_t partial_pops;                            // Partial slabs made current.
+    size_t new_slabs;                               // Slabs taken from the page source.
+    size_t slabs_released;                          // Fully free slabs given back to the page source.
+    size_t remote_frees;                            // Blocks freed by a thread that doesn't own their slab.
+    size_t remote_drained;                          // Remotely freed blocks collected by their owners.
+    size_t depot_bytes;                             // Bytes cached in depot magazines.
+    size_t slab_bytes;                              // Bytes in slabs owned by threads, i.e. the heap.
+    size_t free_bytes;                              // Resident bytes in free slab runs waiting for reuse.
+    size_t decommitted_bytes;                       // Bytes of free slab runs handed back to the OS or never touched.
+    size_t mapped_bytes;                            // Address space reserved from the OS.
+    size_t large_bytes;                             // Bytes in live allocations above SLAB_MAX_SIZE.
+    size_t span_cache_bytes;                        // Bytes in freed large mappings cached for reuse.
+} SlabStats;
+
 void *slab_alloc();
+void *slab_alloc_size(size_t size);
+void *slab_calloc(size_t count, size_t size);
+void *slab_alloc_aligned(size_t size, size_t alignment);
 void slab_free(void *block);
+int slab_owns(void *ptr);
+size_t slab_usable_size(void *block);
+size_t slab_alloc_bulk(void **out, size_t n);
+void slab_free_bulk(void **ptrs, size_t n);
+size_t slab_trim();
+void slab_set_page_mode(SlabPageMode mode);
+void slab_set_prefetch(SlabPrefetchMode mode);
+int slab_set_percpu(int enable);
+void slab_stats(SlabStats *stats);
+
+ThreadCache *slab_thread_cache_create();
+void slab_thread_cache_destroy(ThreadCache *cache);
+ThreadCache *slab_thread_cache_attach(ThreadCache *cache);
+ThreadCache *slab_thread_cache_detach();
+void *slab_alloc_from(ThreadCache *cache, size_t size);
+void slab_free_to(ThreadCache *cache, void *block);
+
+SlabCache *slab_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *), void (*dtor)(void *));
+void *slab_cache_alloc(SlabCache *cache);
+void slab_cache_free(SlabCache *cache, void *object);
+void slab_cache_destroy(SlabCache *cache);
+
+SlabHeap *slab_heap_create(const SlabHeapConfig *config);
+void *slab_heap_alloc(SlabHeap *heap);
+void slab_heap_free(SlabHeap *heap, void *block);
+void slab_heap_destroy(SlabHeap *heap);
+
+SlabArena *slab_arena_create();
+void *slab_arena_alloc(SlabArena *arena, size_t size);
+void slab_arena_reset(SlabArena *arena);
+void slab_arena_destroy(SlabArena *arena);
+
+SlabContext *slab_context_create(SlabContext *parent);
+void *slab_context_alloc(SlabContext *context, size_t size);
+void slab_context_reset(SlabContext *context);
+void slab_context_delete(SlabContext *context);
+void slab_context_mark(SlabContext *context, SlabMark *mark);
+void slab_context_release_to_mark(SlabContext *context, const SlabMark *mark);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <time.h>
 
@@ -8,6 +9,8 @@
 #define THREAD_COUNT 4
 #define ALLOCATIONS_PER_THREAD 1000000
 #define BLOCK_SIZE 64
+#define LIST_NODES (1 << 18)
+#define LIST_ROUNDS 20
 
 typedef enum {
     USE_MALLOC,
@@ -19,6 +22,12 @@ typedef struct {
     int thread_id;
 } ThreadArg;
 
+typedef struct node {
+    struct node *next;
+    long value;
+    char payload[BLOCK_SIZE - sizeof(struct node *) - sizeof(long)];
+} Node;
+
 void *worker(void *arg_ptr) {
     ThreadArg *arg = (ThreadArg *)arg_ptr;
     void **ptrs = malloc(sizeof(void *) * ALLOCATIONS_PER_THREAD);
@@ -103,12 +112,87 @@ double benchmark_singlethreaded(Mode mode) {
     return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 }
 
+/*
+ * Repeatedly build a linked list, walk it and tear it down in random order, so the
+ * blocks of the next build come back scattered and cold like in a long running program.
+ * This is where prefetching the next block in the allocator shows.
+ */
+double benchmark_linked(Mode mode) {
+    Node **nodes = malloc(sizeof(Node *) * LIST_NODES);
+    long sum = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    srand(1);
+    for(int round = 0; round < LIST_ROUNDS; round++) {
+        // Build the list, initializing every node as it is allocated
+        Node *head = NULL;
+        for(int i = 0; i < LIST_NODES; i++) {
+            Node *node = mode == USE_MALLOC ? malloc(sizeof(Node)) : slab_alloc();
+            node->value = i;
+            memset(node->payload, i, sizeof(node->payload));
+            node->next = head;
+            head = node;
+            nodes[i] = node;
+        }
+
+        for(Node *node = head; node; node = node->next)
+            sum += node->value;
+
+        // Free in a random order
+        for(int i = LIST_NODES - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            Node *tmp = nodes[i];
+            nodes[i] = nodes[j];
+            nodes[j] = tmp;
+        }
+        for(int i = 0; i < LIST_NODES; i++) {
+            if(mode == USE_MALLOC)
+                free(nodes[i]);
+            else
+                slab_free(nodes[i]);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    free(nodes);
+    if(sum == 42) printf("\n");    // Keep the walk from being optimized out
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * Compare malloc with slab_alloc under each prefetch mode on linked list builds.
+ */
+void run_linked() {
+    printf("Linked list builds: %d nodes x %d rounds\n\n", LIST_NODES, LIST_ROUNDS);
+
+    double malloc_time = benchmark_linked(USE_MALLOC);
+    printf("malloc:\t\t\t%.6f sec\n", malloc_time);
+
+    const char *names[] = { "slab_alloc:\t\t", "slab_alloc (read):\t", "slab_alloc (write):\t" };
+    SlabPrefetchMode modes[] = { SLAB_PREFETCH_NONE, SLAB_PREFETCH_READ, SLAB_PREFETCH_WRITE };
+    for(int i = 0; i < 3; i++) {
+        slab_set_prefetch(modes[i]);
+        double slab_time = benchmark_linked(USE_SLAB);
+        printf("%s%.6f sec (%.2fx)\n", names[i], slab_time, malloc_time / slab_time);
+    }
+    slab_set_prefetch(SLAB_PREFETCH_NONE);
+}
+
 int main(int argc, char **argv) {
     if(argc > 2) {
-        printf("Usage: benchmark [opt:num_threads]\n");
+        printf("Usage: benchmark [opt:num_threads | linked]\n");
         return -1;
     }
 
+    if(argc == 2 && strcmp(argv[1], "linked") == 0) {
+        run_linked();
+        return 0;
+    }
+
     int thread_count = THREAD_COUNT;
     if(argc == 2) {
         thread_count = atoi(argv[1]);
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc.h"
+
+// Drop-in malloc replacement on top of the slab allocator, built as libthreadalloc.so
+// and loaded with LD_PRELOAD.
+
+#define ALIGN_UP(x, align) (((x) + ((align) - 1)) & ~((align) - 1))     // Align x to the next multiple of align
+
+#define MAPS_LINE_MAX 256                                               // Bytes of a /proc/self/maps line that are looked at, the path is skipped.
+
+/*
+ * Parse a hexadecimal number.
+ * Arguments:
+ *     const char **text - The text, moved past the digits.
+ * Returns:
+ *     uintptr_t - The number.
+ */
+static uintptr_t parse_hex(const char **text) {
+    uintptr_t value = 0;
+    for(;; (*text)++) {
+        char c = **text;
+        if(c >= '0' && c <= '9') value = value * 16 + (c - '0');
+        else if(c >= 'a' && c <= 'f') value = value * 16 + (c - 'a' + 10);
+        else return value;
+    }
+}
+
+/*
+ * Extend a readable range by one line of /proc/self/maps, which looks like
+ * "start-end perms offset dev inode path".
+ * Arguments:
+ *     const char *line - The line.
+ *     uintptr_t want - End of the readable range so far.
+ * Returns:
+ *     uintptr_t - The end of the mapping if it is readable and holds want, want otherwise.
+ */
+static uintptr_t maps_extend(const char *line, uintptr_t want) {
+    uintptr_t start = parse_hex(&line);
+    line++;
+    uintptr_t end = parse_hex(&line);
+    line++;
+
+    return start <= want && want < end && *line == 'r' ? end : want;
+}
+
+/*
+ * Find how many bytes from ptr on can be read, up to a limit, by walking the readable
+ * mappings of /proc/self/maps that follow on from the one holding ptr. It reads into
+ * a buffer on the stack, so it works from inside malloc.
+ * Arguments:
+ *     const void *ptr - Start of the memory.
+ *     size_t limit - Most bytes the caller is interested in.
+ * Returns:
+ *     size_t - Readable bytes from ptr on, at most limit. 0 if the maps can't be read.
+ */
+static size_t readable_bytes(const void *ptr, size_t limit) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return 0;
+
+    uintptr_t want = (uintptr_t)ptr;
+    char buffer[4096];
+    size_t length = 0;
+    int skipping = 0;   // Inside the tail of a line longer than MAPS_LINE_MAX
+    for(;;) {
+        ssize_t got = read(fd, buffer + length, sizeof(buffer) - length);
+        if(got <= 0) break;
+        length += got;
+
+        // Mappings are listed by address, so contiguous ones come one after the other
+        char *line = buffer;
+        char *newline;
+        while((newline = memchr(line, '\n', buffer + length - line))) {
+            if(!skipping)
+                want = maps_extend(line, want);
+            skipping = 0;
+            line = newline + 1;
+        }
+
+        // Keep the partial last line. One too long to keep, for its path, is looked at
+        // now and the rest of it skipped.
+        length -= line - buffer;
+        memmove(buffer, line, length);
+        if(length > MAPS_LINE_MAX) {
+            if(!skipping)
+                want = maps_extend(buffer, want);
+            length = 0;
+            skipping = 1;
+        }
+    }
+    close(fd);
+
+    size_t readable = want - (uintptr_t)ptr;
+    return readable < limit ? readable : limit;
+}
+
+void *malloc(size_t size) {
+    void *ptr = slab_alloc_size(size);
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void free(void *ptr) {
+    if(!ptr) return;
+
+    // Pointers we don't recognize were handed out before we were loaded, leave them be
+    if(slab_owns(ptr))
+        slab_free(ptr);
+}
+
+void *calloc(size_t count, size_t size) {
+    // Zeroing happens in the allocator, which knows which memory is fresh from the OS.
+    // Doing it here after malloc() would also let the compiler fold the pair back into
+    // a calloc() call.
+    void *ptr = slab_calloc(count, size);
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr && slab_owns(ptr) ? slab_usable_size(ptr) : 0;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if(!ptr) return malloc(size);
+    if(!size) {
+        free(ptr);
+        return NULL;
+    }
+
+    // Blocks we don't recognize come from the dynamic loader's bootstrap malloc, and
+    // nothing knows their size. They move over to us with up to size bytes copied,
+    // stopping where readable memory ends. Whatever lies past the old block only lands
+    // in the part of the new one that realloc() leaves unspecified. Like in free(),
+    // the old block is left be.
+    if(!slab_owns(ptr)) {
+        size_t readable = readable_bytes(ptr, size);
+        if(!readable) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        void *moved = malloc(size);
+        if(moved)
+            memcpy(moved, ptr, readable);
+        return moved;
+    }
+
+    // Growing within the block or mapping, or shrinking by less than half, keeps the
+    // memory in place
+    size_t usable = slab_usable_size(ptr);
+    if(size <= usable && size > usable / 2)
+        return ptr;
+
+    void *moved = malloc(size);
+    if(!moved) return NULL;
+
+    memcpy(moved, ptr, usable < size ? usable : size);
+    free(ptr);
+    return moved;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    if(alignment < sizeof(void *) || (alignment & (alignment - 1))) return EINVAL;
+
+    void *ptr = slab_alloc_aligned(size, alignment);
+    if(!ptr) return ENOMEM;
+
+    *out = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if(!alignment || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *ptr = slab_alloc_aligned(size, alignment);
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    // Like glibc, round alignments that aren't a power of two up to the next one
+    if(alignment > SIZE_MAX / 2 + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t power = 1;
+    while(power < alignment)
+        power <<= 1;
+
+    return aligned_alloc(power, size);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return aligned_alloc(page, ALIGN_UP(size, page));
+}
@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "alloc.h"
+
+#define CHURN_ROUNDS 50
+#define HEAP_BLOCKS 200000
+#define HEAP_BYTES (32 * 1024 * 1024)
+#define STATS_BLOCKS 5000
+#define BULK_BLOCKS 3000
+#define OBJECT_BLOCKS 20000
+#define OBJECT_THREADS 4
+#define OBJECT_MAGIC 0x6f626a65
+#define FIBER_BLOCKS 4000
+
+// Stop at the first broken expectation, naming it and where it is
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while(0)
+
+size_t mapped_bytes() {
+    SlabStats stats;
+    slab_stats(&stats);
+    return stats.mapped_bytes;
+}
+
+/*
+ * Fill arenas with small and large allocations and destroy or reset them over and
+ * over. Once the first round has warmed the page source up, none of it may need new
+ * address space.
+ */
+void test_arena_churn() {
+    size_t baseline = 0;
+    for(int round = 0; round < CHURN_ROUNDS; round++) {
+        // Keep every arena full at once so chunks come and go by the hundred
+        SlabArena *arenas[8];
+        for(int i = 0; i < 8; i++) {
+            CHECK((arenas[i] = slab_arena_create()) != NULL);
+            for(int j = 0; j < 200; j++) {
+                char *mem = slab_arena_alloc(arenas[i], 100 + j * 300);
+                CHECK(mem != NULL);
+                memset(mem, j, 100 + j * 300);
+            }
+        }
+        for(int i = 0; i < 8; i++) {
+            slab_arena_reset(arenas[i]);
+            CHECK(slab_arena_alloc(arenas[i], 1000) != NULL);
+            slab_arena_destroy(arenas[i]);
+        }
+
+        if(round == 0)
+            baseline = mapped_bytes();
+        CHECK(mapped_bytes() == baseline);
+    }
+}
+
+/*
+ * Build trees of contexts three levels deep, fill them and delete them from the root
+ * over and over. The address space must stay where the first round left it.
+ */
+void test_context_churn() {
+    size_t baseline = 0;
+    for(int round = 0; round < CHURN_ROUNDS; round++) {
+        SlabContext *root = slab_context_create(NULL);
+        SlabContext *middle = NULL;
+        CHECK(root != NULL);
+        for(int i = 0; i < 6; i++) {
+            SlabContext *child = slab_context_create(root);
+            CHECK(child != NULL);
+            for(int j = 0; j < 4; j++) {
+                SlabContext *grandchild = slab_context_create(child);
+                CHECK(grandchild != NULL);
+                for(int k = 0; k < 100; k++)
+                    CHECK(slab_context_alloc(grandchild, 64 + k * 400) != NULL);
+            }
+            CHECK(slab_context_alloc(child, 100000) != NULL);
+            if(i == 3)
+                middle = child;
+        }
+
+        // Drop one subtree on its own before the rest goes with the root
+        slab_context_delete(middle);
+        slab_context_delete(root);
+
+        if(round == 0)
+            baseline = mapped_bytes();
+        CHECK(mapped_bytes() == baseline);
+    }
+}
+
+/*
+ * Release a context to marks taken at different depths and check that it resumes
+ * allocating exactly where it stood when each mark was taken.
+ */
+void test_context_marks() {
+    SlabContext *context = slab_context_create(NULL);
+    CHECK(context != NULL);
+    CHECK(slab_context_alloc(context, 100) != NULL);
+
+    SlabMark outer, inner;
+    slab_context_mark(context, &outer);
+    char *first = slab_context_alloc(context, 48);
+    CHECK(first != NULL);
+    slab_context_release_to_mark(context, &outer);
+    CHECK(slab_context_alloc(context, 48) == first);
+
+    // Spill well past the current chunk, with large allocations in between
+    slab_context_mark(context, &inner);
+    char *second = slab_context_alloc(context, 32);
+    for(int i = 0; i < 1000; i++)
+        CHECK(slab_context_alloc(context, i % 10 ? 500 : 50000) != NULL);
+    size_t grown = mapped_bytes();
+    slab_context_release_to_mark(context, &inner);
+    CHECK(slab_context_alloc(context, 32) == second);
+
+    // The chunks given back are reused by the next round instead of new ones
+    for(int i = 0; i < 1000; i++)
+        CHECK(slab_context_alloc(context, i % 10 ? 500 : 50000) != NULL);
+    CHECK(mapped_bytes() == grown);
+
+    slab_context_release_to_mark(context, &outer);
+    CHECK(slab_context_alloc(context, 48) == first);
+    slab_context_delete(context);
+}
+
+/*
+ * Fill heaps of several geometries, check that no two blocks overlap, free them in an
+ * interleaved order and start over. Multi-slab runs must be reused as a whole, and
+ * destroying the heap must give all of its address space back.
+ */
+void test_heap_churn() {
+    SlabHeapConfig configs[] = {
+        { .block_size = 8192, .slab_size = 1024 * 1024 },
+        { .block_size = 64, .slab_size = 256 * 1024 },
+        { .block_size = 3000, .slab_size = 192 * 1024, .magazine_size = 8, .empty_slabs = 2 },
+    };
+    static long *blocks[HEAP_BLOCKS];
+
+    for(size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+        size_t before = mapped_bytes();
+        SlabHeap *heap = slab_heap_create(&configs[c]);
+        CHECK(heap != NULL);
+
+        // Enough blocks for dozens of slabs, so runs come and go in bulk
+        size_t count = HEAP_BYTES / configs[c].block_size;
+        if(count > HEAP_BLOCKS)
+            count = HEAP_BLOCKS;
+
+        size_t baseline = 0;
+        for(int round = 0; round < CHURN_ROUNDS / 5; round++) {
+            for(size_t i = 0; i < count; i++) {
+                CHECK((blocks[i] = slab_heap_alloc(heap)) != NULL);
+                blocks[i][0] = i;
+                blocks[i][configs[c].block_size / sizeof(long) - 1] = i;
+            }
+            for(size_t i = 0; i < count; i++)
+                CHECK(blocks[i][0] == (long)i && blocks[i][configs[c].block_size / sizeof(long) - 1] == (long)i);
+
+            for(size_t i = 0; i < count; i += 2)
+                slab_heap_free(heap, blocks[i]);
+            for(size_t i = 1; i < count; i += 2)
+                slab_heap_free(heap, blocks[i]);
+
+            if(round == 0)
+                baseline = mapped_bytes();
+            CHECK(mapped_bytes() == baseline);
+        }
+
+        slab_heap_destroy(heap);
+        CHECK(mapped_bytes() == before);
+    }
+}
+
+// Blocks handed from the thread that allocated them to one that frees them
+typedef struct handoff {
+    void **blocks;
+    size_t count;
+} Handoff;
+
+void *free_handoff(void *arg) {
+    Handoff *handoff = (Handoff *)arg;
+    for(size_t i = 0; i < handoff->count; i++)
+        slab_free(handoff->blocks[i]);
+    return NULL;
+}
+
+/*
+ * Check that the counters follow allocations and frees exactly, large ones included,
+ * and that blocks freed by another thread than the one that allocated them balance
+ * out instead of wrapping the byte counts around.
+ */
+void test_stats() {
+    static void *blocks[STATS_BLOCKS];
+    SlabStats before, during, after;
+
+    slab_stats(&before);
+    for(int i = 0; i < STATS_BLOCKS; i++)
+        CHECK((blocks[i] = slab_alloc_size(100)) != NULL);
+    void *large = slab_alloc_size(100000);
+    CHECK(large != NULL);
+    slab_stats(&during);
+    CHECK(during.allocs - before.allocs == STATS_BLOCKS);
+    CHECK(during.bytes_in_use - before.bytes_in_use == STATS_BLOCKS * slab_usable_size(blocks[0]));
+    CHECK(during.large_bytes - before.large_bytes == slab_usable_size(large));
+
+    // Free everything from a thread of its own
+    Handoff handoff = { blocks, STATS_BLOCKS };
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, free_handoff, &handoff) == 0);
+    pthread_join(thread, NULL);
+    slab_free(large);
+
+    slab_stats(&after);
+    CHECK(after.frees - before.frees == STATS_BLOCKS);
+    CHECK(after.bytes_in_use == before.bytes_in_use);
+    CHECK(after.large_bytes == before.large_bytes);
+    CHECK(after.remote_frees > before.remote_frees);
+}
+
+void *free_bulk_handoff(void *arg) {
+    Handoff *handoff = (Handoff *)arg;
+    slab_free_bulk(handoff->blocks, handoff->count);
+    return NULL;
+}
+
+/*
+ * Allocate in bursts, free half of each burst from another thread and the rest in
+ * place, and check that no two blocks of a burst are the same and that nothing is
+ * left behind or leaked.
+ */
+void test_bulk() {
+    static void *blocks[BULK_BLOCKS];
+    SlabStats before, after;
+    slab_stats(&before);
+
+    size_t baseline = 0;
+    for(int round = 0; round < CHURN_ROUNDS; round++) {
+        CHECK(slab_alloc_bulk(blocks, BULK_BLOCKS) == BULK_BLOCKS);
+        for(size_t i = 0; i < BULK_BLOCKS; i++) {
+            CHECK(slab_usable_size(blocks[i]) >= 64);
+            memset(blocks[i], 0, 64);
+            *(size_t *)blocks[i] = i;
+        }
+        for(size_t i = 0; i < BULK_BLOCKS; i++)
+            CHECK(*(size_t *)blocks[i] == i);
+
+        Handoff handoff = { blocks, BULK_BLOCKS / 2 };
+        pthread_t thread;
+        CHECK(pthread_create(&thread, NULL, free_bulk_handoff, &handoff) == 0);
+        pthread_join(thread, NULL);
+        slab_free_bulk(blocks + BULK_BLOCKS / 2, BULK_BLOCKS - BULK_BLOCKS / 2);
+
+        if(round == 0)
+            baseline = mapped_bytes();
+        CHECK(mapped_bytes() == baseline);
+    }
+
+    slab_stats(&after);
+    CHECK(after.allocs - before.allocs == CHURN_ROUNDS * BULK_BLOCKS);
+    CHECK(after.frees - before.frees == CHURN_ROUNDS * BULK_BLOCKS);
+    CHECK(after.bytes_in_use == before.bytes_in_use);
+}
+
+/*
+ * Check pointer lookups through the page map: interior pointers of spans and of
+ * mappings resolve to their allocation, memory that isn't ours doesn't, and aligned
+ * allocations honour their alignment.
+ */
+void test_page_map() {
+    int local = 0;
+    void *foreign = malloc(100);
+    CHECK(!slab_owns(&local));
+    CHECK(!slab_owns(foreign));
+    free(foreign);
+
+    char *small = slab_alloc_size(24);
+    char *span = slab_alloc_size(200000);
+    char *mapping = slab_alloc_size(8 * 1024 * 1024);
+    CHECK(small && span && mapping);
+    CHECK(slab_owns(small) && slab_usable_size(small) >= 24);
+    CHECK(slab_owns(span + 199999) && slab_usable_size(span) >= 200000);
+    CHECK(slab_owns(mapping + 5 * 1024 * 1024) && slab_usable_size(mapping) >= 8 * 1024 * 1024);
+
+    // Freed span tails go back to the page source and come out as slabs of their own
+    slab_free(span);
+    void *reused[8];
+    for(int i = 0; i < 8; i++) {
+        CHECK((reused[i] = slab_alloc_size(6000)) != NULL);
+        CHECK(slab_usable_size(reused[i]) >= 6000);
+    }
+    for(int i = 0; i < 8; i++)
+        slab_free(reused[i]);
+
+    size_t alignments[] = { 64, 4096, 65536, 1024 * 1024 };
+    for(int i = 0; i < 4; i++) {
+        char *aligned = slab_alloc_aligned(1000, alignments[i]);
+        CHECK(aligned != NULL && ((uintptr_t)aligned & (alignments[i] - 1)) == 0);
+        CHECK(slab_owns(aligned + 999));
+        slab_free(aligned);
+    }
+
+    slab_free(small);
+    slab_free(mapping);
+}
+
+// Objects of the cache in test_objects(), counting how often they are built and torn down
+typedef struct object {
+    unsigned magic;                     // OBJECT_MAGIC while constructed.
+    unsigned uses;                      // Times handed out, kept across frees.
+    char payload[40];
+} Object;
+
+static atomic_size_t objects_constructed;
+static atomic_size_t objects_destroyed;
+
+void object_ctor(void *ptr) {
+    Object *object = (Object *)ptr;
+    object->magic = OBJECT_MAGIC;
+    object->uses = 0;
+    atomic_fetch_add(&objects_constructed, 1);
+}
+
+void object_dtor(void *ptr) {
+    Object *object = (Object *)ptr;
+    CHECK(object->magic == OBJECT_MAGIC);
+    object->magic = 0;
+    atomic_fetch_add(&objects_destroyed, 1);
+}
+
+// Objects allocated by one thread and handed to another that frees them
+typedef struct object_handoff {
+    SlabCache *cache;
+    Object **objects;
+    size_t reused;                      // Objects handed out again that kept their state.
+} ObjectHandoff;
+
+void *free_objects(void *arg) {
+    ObjectHandoff *handoff = (ObjectHandoff *)arg;
+    for(int i = 1; i < OBJECT_BLOCKS; i += 2)
+        slab_cache_free(handoff->cache, handoff->objects[i]);
+    return NULL;
+}
+
+void *alloc_objects(void *arg) {
+    ObjectHandoff *handoff = (ObjectHandoff *)arg;
+    for(int round = 0; round < CHURN_ROUNDS / 10; round++) {
+        for(int i = 0; i < OBJECT_BLOCKS; i++) {
+            Object *object = slab_cache_alloc(handoff->cache);
+            CHECK(object != NULL && object->magic == OBJECT_MAGIC);
+            if(object->uses++ > 0)
+                handoff->reused++;
+            memset(object->payload, 0xa5, sizeof(object->payload));
+            handoff->objects[i] = object;
+        }
+        // Give the even half back here, the odd half from a thread of its own
+        for(int i = 0; i < OBJECT_BLOCKS; i += 2)
+            slab_cache_free(handoff->cache, handoff->objects[i]);
+        pthread_t thread;
+        ObjectHandoff odd = { handoff->cache, handoff->objects, 0 };
+        CHECK(pthread_create(&thread, NULL, free_objects, &odd) == 0);
+        pthread_join(thread, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Churn an object cache with constructor and destructor from several threads at once,
+ * freeing half of the objects from threads that didn't allocate them. Objects must come
+ * out constructed, and once the cache is destroyed every constructor call must have been
+ * matched by a destructor call.
+ */
+void test_objects() {
+    SlabCache *cache = slab_cache_create("test objects", sizeof(Object), 0, object_ctor, object_dtor);
+    CHECK(cache != NULL);
+
+    static Object *objects[OBJECT_THREADS][OBJECT_BLOCKS];
+    ObjectHandoff handoffs[OBJECT_THREADS];
+    pthread_t threads[OBJECT_THREADS];
+    for(int i = 0; i < OBJECT_THREADS; i++) {
+        handoffs[i] = (ObjectHandoff){ cache, objects[i], 0 };
+        CHECK(pthread_create(&threads[i], NULL, alloc_objects, &handoffs[i]) == 0);
+    }
+    // Objects remember their uses, so some must have been handed out more than once
+    for(int i = 0; i < OBJECT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(handoffs[i].reused > 0);
+    }
+
+    CHECK(atomic_load(&objects_constructed) > 0);
+    slab_cache_destroy(cache);
+    CHECK(atomic_load(&objects_destroyed) == atomic_load(&objects_constructed));
+}
+
+// A cache moving between threads with the blocks it allocated, like a fiber would
+typedef struct fiber {
+    ThreadCache *cache;
+    void **blocks;
+} Fiber;
+
+void *fiber_alloc(void *arg) {
+    Fiber *fiber = (Fiber *)arg;
+    for(int i = 0; i < FIBER_BLOCKS; i++) {
+        fiber->blocks[i] = slab_alloc_from(fiber->cache, 16 + i % 2000);
+        CHECK(fiber->blocks[i] != NULL);
+        memset(fiber->blocks[i], i & 0xff, 16);
+    }
+    return NULL;
+}
+
+void *fiber_free(void *arg) {
+    Fiber *fiber = (Fiber *)arg;
+    for(int i = 0; i < FIBER_BLOCKS; i += 2) {
+        CHECK(*(unsigned char *)fiber->blocks[i] == (i & 0xff));
+        slab_free_to(fiber->cache, fiber->blocks[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Check the explicit caches: a cache allocates on one thread and frees on another as
+ * it migrates, an attached cache serves slab_alloc_size() until it is detached, and
+ * creating and destroying caches over and over reuses the parked ones.
+ */
+void test_thread_caches() {
+    static void *blocks[FIBER_BLOCKS];
+    SlabStats before, after;
+    slab_stats(&before);
+
+    // Migrate the cache across threads between allocating and freeing
+    Fiber fiber = { slab_thread_cache_create(), blocks };
+    CHECK(fiber.cache != NULL);
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, fiber_alloc, &fiber) == 0);
+    pthread_join(thread, NULL);
+    CHECK(pthread_create(&thread, NULL, fiber_free, &fiber) == 0);
+    pthread_join(thread, NULL);
+    for(int i = 1; i < FIBER_BLOCKS; i += 2)
+        slab_free_to(fiber.cache, blocks[i]);
+
+    // A block freed to the cache is the next one handed out once the cache is attached
+    void *block = slab_alloc_from(fiber.cache, 100);
+    CHECK(block != NULL);
+    slab_free_to(fiber.cache, block);
+    ThreadCache *previous = slab_thread_cache_attach(fiber.cache);
+    void *again = slab_alloc_size(100);
+    CHECK(again == block);
+    slab_free(again);
+    CHECK(slab_thread_cache_detach() == fiber.cache);
+    CHECK(slab_thread_cache_attach(previous) == NULL);
+    slab_thread_cache_destroy(fiber.cache);
+
+    slab_stats(&after);
+    CHECK(after.bytes_in_use == before.bytes_in_use);
+    CHECK(after.allocs - before.allocs == FIBER_BLOCKS + 2);
+    CHECK(after.frees - before.frees == FIBER_BLOCKS + 2);
+
+    // Destroyed caches are parked and adopted by the next create
+    for(int round = 0; round < CHURN_ROUNDS; round++) {
+        ThreadCache *cache = slab_thread_cache_create();
+        CHECK(cache != NULL);
+        void *block = slab_alloc_from(cache, 64);
+        CHECK(block != NULL);
+        slab_free_to(cache, block);
+        slab_thread_cache_destroy(cache);
+    }
+    slab_stats(&before);
+    CHECK(before.threads == after.threads);
+}
+
+int main() {
+    test_arena_churn();
+    printf("arena churn: ok\n");
+    test_context_churn();
+    printf("context churn: ok\n");
+    test_context_marks();
+    printf("context marks: ok\n");
+    test_heap_churn();
+    printf("heap churn: ok\n");
+    test_stats();
+    printf("stats: ok\n");
+    test_bulk();
+    printf("bulk: ok\n");
+    test_page_map();
+    printf("page map: ok\n");
+    test_objects();
+    printf("objects: ok\n");
+    test_thread_caches();
+    printf("thread caches: ok\n");
+
+    return 0;
+}